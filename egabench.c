@@ -29,12 +29,15 @@
  * Copyright (c) 1992 Apogee Software, Ltd.
  */
 
+#include <alloc.h>
 #include <conio.h>
 #include <dos.h>
 #include <mem.h>
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 
 typedef unsigned char byte;
@@ -45,10 +48,21 @@ typedef void interrupt (far *InterruptHandler)(void);
 
 #define DEFAULT_ITERATIONS 1000
 #define DEFAULT_TIMER_RATE 1000
+#define DEFAULT_SPRITES    16
 
 #define VMEM_SEG       0xa000
 #define VMEM_TILES_SEG 0xa400
 
+// Offset of the tile storage relative to VMEM_SEG
+#define VMEM_TILES_OFFSET ((VMEM_TILES_SEG - VMEM_SEG) << 4)
+
+// Size of a display page in EGA mode 0xD, as used by the BIOS
+#define PAGE_SIZE 0x2000
+
+#define MAP_WIDTH  40
+#define MAP_HEIGHT 25
+#define MAP_CELLS  (MAP_WIDTH * MAP_HEIGHT)
+
 static byte far* VMEM = MK_FP(VMEM_SEG, 0);
 
 
@@ -115,18 +129,30 @@ static dword timerTickCount;
 
 static dword tickCounter;
 
+// Total number of PIT input clocks that have elapsed since installing our
+// timer, updated once per timer interrupt. Combined with the PIT's current
+// counter value, this gives us a clock with a resolution of 1/PIT_FREQUENCY
+// seconds (~0.84 us), see ReadHighResClock().
+static volatile dword pitTicks;
+
 
-static void SetPIT0Value(word value)
+#define PIT_FREQUENCY 1193182L
+
+#define PIT_MODE_RATE_GENERATOR 2
+#define PIT_MODE_SQUARE_WAVE    3
+
+
+static void SetPIT0Value(word value, byte mode)
 {
   /*
   Bit Pattern | Interpretation
   ------------|---------------
   00xxxxxx    | Select timer channel 0
   xx11xxxx    | Access Mode: "Low byte, followed by high byte"
-  xxxx011x    | Mode 3: Square wave generator
+  xxxxmmmx    | Mode: 2 = rate generator, 3 = square wave generator
   xxxxxxx0    | 16-bit binary counting mode
   */
-  outportb(0x0043, 0x36);
+  outportb(0x0043, 0x30 | (mode << 1));
 
   /* PIT counter 0 divisor (low, high byte) */
   outportb(0x0040, value);
@@ -138,15 +164,45 @@ static void SetPIT0Value(word value)
 
 static void SetInterruptRate(word desiredRate)
 {
-  SetPIT0Value((word)(1193182L / desiredRate));
+  // We use mode 2 instead of the BIOS default mode 3. Both fire the interrupt
+  // at the same rate, but in mode 3, the counter decrements by two and runs
+  // through its range twice per period, which makes its current value useless
+  // for telling how far we are into the current period.
+  SetPIT0Value(
+    (word)(PIT_FREQUENCY / desiredRate), PIT_MODE_RATE_GENERATOR);
 }
 
 
+// Retrace tracking, for triple-buffered presentation. While enabled, the timer
+// interrupt predicts when the next vertical retrace is due, based on the time
+// of the previous one. If that's before the following interrupt, it polls for
+// the retrace, and then marks the page in latchingPage as shown: Its start
+// address was written to the CRTC before the retrace, and is now in effect.
+#define NO_PAGE -1
+
+static volatile int trackingRetraces;
+static dword refreshPeriod;
+static dword nextRetraceTicks;
+static volatile int latchingPage = NO_PAGE;
+static volatile int shownPage;
+
+// Time of the retrace at which the last page became visible
+static volatile dword lastFlipTicks;
+
+static void TrackRetrace(void);
+
+
 // This simply increments the tick counter, and invokes the original
 // timer interrupt handler at (roughly) the original rate.
 static void interrupt TimerInterruptService(void)
 {
   tickCounter++;
+  pitTicks += pit0Value;
+
+  if (trackingRetraces)
+  {
+    TrackRetrace();
+  }
 
   asm mov   ax,[WORD PTR timerTickCount]
   asm add   ax,[WORD PTR pit0Value]
@@ -174,16 +230,215 @@ static void InstallTimer(int rate)
 }
 
 
-static void WaitTicks(int ticks)
+// Returns the number of PIT input clocks elapsed since installing the timer.
+// Only differences between two readings are meaningful. To convert to
+// milliseconds, divide by PIT_FREQUENCY / 1000.
+static dword ReadHighResClock(void)
+{
+  word count;
+  dword ticks;
+
+  asm pushf
+  asm cli
+
+  // Latch the current count of channel 0, then read it (low, high byte).
+  // In mode 2, the counter runs from pit0Value down to 1 once per period.
+  outportb(0x0043, 0x00);
+  count = inportb(0x0040);
+  count |= inportb(0x0040) << 8;
+
+  ticks = pitTicks;
+
+  // If the counter wrapped around while interrupts were disabled, the
+  // interrupt service routine hasn't accounted for it yet. The PIC's
+  // interrupt request register tells us whether IRQ 0 is pending. A pending
+  // interrupt combined with a low count means that the counter wrapped after
+  // we latched it, in which case the count is still relative to the old
+  // period.
+  outportb(0x0020, 0x0a);
+  if ((inportb(0x0020) & 1) && count > pit0Value / 2)
+  {
+    ticks += pit0Value;
+  }
+
+  asm popf
+
+  return ticks + (pit0Value - count);
+}
+
+
+// Interrupt-free timing: For measurements without any interrupts firing, our
+// timer interrupt is removed, and channel 0 runs through its full range of
+// 65536 clocks (the BIOS default rate) in rate generator mode, with the
+// original handler installed. While interrupts are disabled, the elapsed time
+// can then be determined from two counter readings. ReadHighResClock() must
+// not be used in this mode.
+static int interruptFreeTimingActive;
+
+static void BeginInterruptFreeTiming(void)
+{
+  interruptFreeTimingActive = 1;
+
+  disable();
+
+  setvect(8, savedInt8);
+  SetPIT0Value(0, PIT_MODE_RATE_GENERATOR);
+
+  enable();
+}
+
+
+static void EndInterruptFreeTiming(void)
+{
+  disable();
+
+  setvect(8, TimerInterruptService);
+  SetInterruptRate(timerRate);
+
+  enable();
+
+  interruptFreeTimingActive = 0;
+}
+
+
+static word ReadPIT0Count(void)
+{
+  word count;
+
+  outportb(0x0043, 0x00);
+  count = inportb(0x0040);
+  count |= inportb(0x0040) << 8;
+
+  return count;
+}
+
+
+static int IsTimerInterruptPending(void)
+{
+  outportb(0x0020, 0x0a);
+  return inportb(0x0020) & 1;
+}
+
+
+// Called from the timer interrupt while retrace tracking is enabled. Polling
+// starts at most one timer period before the retrace is due, and stops once
+// the next timer interrupt is pending, to continue in that one. Otherwise,
+// the counter could wrap around a second time, and ReadHighResClock() would
+// go wrong. If the retrace hasn't started one period after it was due, we
+// assume that it was missed, and continue with the predicted time.
+static void TrackRetrace(void)
+{
+  dword now = ReadHighResClock();
+  int inRetrace;
+
+  if ((long)(nextRetraceTicks - now) >= (long)pit0Value)
+  {
+    return;
+  }
+
+  while (
+    !(inRetrace = inportb(0x03da) & 8) && !IsTimerInterruptPending());
+
+  now = ReadHighResClock();
+
+  if (!inRetrace)
+  {
+    if ((long)(now - nextRetraceTicks) < (long)pit0Value)
+    {
+      return;
+    }
+
+    now = nextRetraceTicks;
+  }
+
+  nextRetraceTicks = now + refreshPeriod;
+
+  if (latchingPage != NO_PAGE)
+  {
+    shownPage = latchingPage;
+    latchingPage = NO_PAGE;
+    lastFlipTicks = now;
+  }
+}
+
+
+// Starts retrace tracking, with page 0 on screen. Must be called right after
+// a retrace has started.
+static void BeginRetraceTracking(dword refreshTicks)
+{
+  disable();
+
+  refreshPeriod = refreshTicks;
+  lastFlipTicks = ReadHighResClock();
+  nextRetraceTicks = lastFlipTicks + refreshTicks;
+  shownPage = 0;
+  latchingPage = NO_PAGE;
+  trackingRetraces = 1;
+
+  enable();
+}
+
+
+static void EndRetraceTracking(void)
+{
+  trackingRetraces = 0;
+}
+
+
+// Runs the given function with interrupts disabled, and returns the number of
+// PIT clocks it took. Must be called between BeginInterruptFreeTiming() and
+// EndInterruptFreeTiming().
+//
+// A difference of two counts is correct modulo 65536, so this only works for
+// functions taking less than one period (65536 clocks, ~55 ms). If the
+// counter wrapped around in between, an interrupt request is pending
+// afterwards. If the end count is then still below the start count, at least
+// a full period has passed, and TIMING_OVERFLOW is returned. But a second
+// wrap can't be told apart from a single one, since there's only one request
+// bit, so callers need to make sure that the function takes well below one
+// period, see INTERRUPT_FREE_MAX_TICKS.
+#define TIMING_OVERFLOW 0xFFFFFFFFL
+
+// Frames taking longer than this (~41 ms) aren't timed without interrupts,
+// leaving some margin below one period for variations in frame time
+#define INTERRUPT_FREE_MAX_TICKS 0xC000L
+
+static dword TimeWithoutInterrupts(void (*func)(void))
 {
-  tickCounter = 0;
-  while (tickCounter < ticks);
+  word start;
+  word end;
+  int wrapped;
+
+  // Make sure no interrupt request is pending when we start, letting the BIOS
+  // handle it otherwise
+  for (;;)
+  {
+    disable();
+
+    if (!IsTimerInterruptPending())
+    {
+      break;
+    }
+
+    enable();
+  }
+
+  start = ReadPIT0Count();
+  func();
+  end = ReadPIT0Count();
+  wrapped = IsTimerInterruptPending();
+
+  enable();
+
+  return wrapped && end < start ? TIMING_OVERFLOW : (word)(start - end);
 }
 
 
 static void WaitMs(int ms)
 {
-  WaitTicks(ms / (DEFAULT_TIMER_RATE / timerRate));
+  dword start = ReadHighResClock();
+
+  while (ReadHighResClock() - start < (dword)ms * (PIT_FREQUENCY / 1000));
 }
 
 
@@ -192,12 +447,99 @@ static void RemoveTimer(void)
   disable();
 
   setvect(8, savedInt8);
-  SetPIT0Value(0);
+  SetPIT0Value(0, PIT_MODE_SQUARE_WAVE);
 
   enable();
 }
 
 
+// Returns 86 for an 8086/80186, 286, 386, or 486 for a 486 or newer. On the
+// 8086/80186, bits 12-15 of the flags register are always set, while on the
+// 286 in real mode, bits 12-14 are always clear. The 386 doesn't have the
+// alignment check flag (bit 18 of EFLAGS), so it can't be toggled.
+//
+// As with movsd, 32-bit instructions are emitted via operand size prefixes.
+static int GetCpuClass(void)
+{
+  asm pushf
+  asm pop   ax
+  asm mov   cx, ax
+
+  asm mov   bx, 86
+  asm and   ax, 0x0fff
+  asm push  ax
+  asm popf
+  asm pushf
+  asm pop   ax
+  asm and   ax, 0xf000
+  asm cmp   ax, 0xf000
+  asm je    done
+
+  asm mov   bx, 286
+  asm mov   ax, cx
+  asm or    ax, 0x7000
+  asm push  ax
+  asm popf
+  asm pushf
+  asm pop   ax
+  asm and   ax, 0x7000
+  asm jz    done
+
+  asm mov   bx, 386
+  asm db    0x66
+  asm pushf                                 // pushfd
+  asm db    0x66
+  asm pop   ax                              // pop eax
+  asm db    0x66
+  asm mov   dx, ax                          // mov edx, eax
+  asm db    0x66, 0x35, 0x00, 0x00, 0x04, 0x00  // xor eax, 0x40000
+  asm db    0x66
+  asm push  ax                              // push eax
+  asm db    0x66
+  asm popf                                  // popfd
+  asm db    0x66
+  asm pushf                                 // pushfd
+  asm db    0x66
+  asm pop   ax                              // pop eax
+  asm db    0x66
+  asm xor   ax, dx                          // xor eax, edx
+  asm db    0x66
+  asm push  dx                              // push edx
+  asm db    0x66
+  asm popf                                  // popfd
+  asm db    0x66
+  asm shr   ax, 16                          // shr eax, 16
+  asm test  ax, 4
+  asm jz    done
+
+  asm mov   bx, 486
+
+done:
+  asm push  cx
+  asm popf
+
+  return _BX;
+}
+
+
+// Returns non-zero if the CPU is a 386 or newer
+static int Is386(void)
+{
+  return GetCpuClass() >= 386;
+}
+
+
+// Returns non-zero if the video card is a VGA or newer. EGA BIOSes don't
+// support the read display combination code function, and leave AL unchanged.
+static int IsVga(void)
+{
+  _AX = 0x1a00;
+  geninterrupt(0x10);
+
+  return _AL == 0x1a;
+}
+
+
 static void InitVideo(void)
 {
   // Set EGA mode 0xD: 320x200, 16 colors
@@ -217,6 +559,65 @@ static void SetDisplayPage(int page)
 }
 
 
+// Sets the CRTC start address, i.e. the offset in video memory that appears
+// at the top-left of the screen. Takes effect at the start of the next frame.
+static void SetStartAddress(word offset)
+{
+  outport(0x03d4, (offset & 0xff00) | 0x0c);
+  outport(0x03d4, (offset << 8) | 0x0d);
+}
+
+
+// Sets the CRTC offset register, i.e. the distance between the start of two
+// consecutive lines in video memory, in units of 2 bytes. The default for
+// mode 0xD is 20 (40 bytes).
+static void SetLineOffset(byte offset)
+{
+  outport(0x03d4, (offset << 8) | 0x13);
+}
+
+
+// Shifts the screen content to the left by the given number of pixels (0-7)
+static void SetPelPanning(byte pixels)
+{
+  // Reading the input status register resets the attribute controller's
+  // flip-flop, so that the next write to 0x3c0 is interpreted as an index.
+  // Bit 5 of the index needs to be set, otherwise the display is blanked.
+  inportb(0x03da);
+  outportb(0x03c0, 0x20 | 0x13);
+  outportb(0x03c0, pixels);
+}
+
+
+// Waits until the start of the next vertical retrace. If the retrace is
+// already in progress, waits for it to end first, so that the caller always
+// sees a complete blanking interval.
+static void WaitForRetrace(void)
+{
+  while (inportb(0x03da) & 8);
+  while (!(inportb(0x03da) & 8));
+}
+
+
+// Returns the duration of one display refresh in PIT ticks, averaged over a
+// few frames.
+static dword MeasureRefreshTicks(void)
+{
+  dword start;
+  int i;
+
+  WaitForRetrace();
+  start = ReadHighResClock();
+
+  for (i = 0; i < 8; i++)
+  {
+    WaitForRetrace();
+  }
+
+  return (ReadHighResClock() - start) / 8;
+}
+
+
 static void ExitVideo(void)
 {
   // Go back to text mode
@@ -224,6 +625,142 @@ static void ExitVideo(void)
 }
 
 
+/*******************************************************************************
+
+  Profiling
+
+  Building with -DPROFILE enables the PROFILE_BEGIN/PROFILE_END macros, which
+  time a section of code via ReadHighResClock(), and accumulate the number of
+  calls, total and maximum time per section. The summary is printed at the
+  end of the report. Otherwise, the macros expand to nothing. The time taken
+  by the probes themselves is measured at startup and subtracted from each
+  measurement.
+
+  The probes clobber all registers except for SI, DI, BP and the segment
+  registers, so they can only be placed between asm statements if no other
+  registers are live at that point.
+
+*******************************************************************************/
+
+#define PROFILE_PLANE_SELECT 0
+#define PROFILE_PLANE_ROWS   1
+#define PROFILE_TILE_UPLOAD  2
+#define PROFILE_FLUSH_SPANS  3
+#define PROFILE_CALIBRATION  4
+#define NUM_PROFILE_SECTIONS 5
+
+#ifdef PROFILE
+
+static const char* PROFILE_SECTION_NAMES[NUM_PROFILE_SECTIONS] = {
+  "Plane select (batched rows)",
+  "Plane rows (batched rows)",
+  "Tile upload (tile cache)",
+  "Flush spans (back buffer)",
+  "Calibration"
+};
+
+typedef struct
+{
+  dword count;
+  dword totalTicks;
+  dword maxTicks;
+  dword start;
+} ProfileSection;
+
+static ProfileSection profileSections[NUM_PROFILE_SECTIONS];
+
+// Clocks taken by an empty pair of probes
+static dword profileOverhead;
+
+
+#define PROFILE_BEGIN(id) (profileSections[id].start = ReadHighResClock())
+#define PROFILE_END(id)   EndProfileSection(id)
+
+
+// Sections ending during interrupt-free timing are ignored, since
+// ReadHighResClock() doesn't work then
+static void EndProfileSection(int id)
+{
+  dword ticks = ReadHighResClock();
+  ProfileSection* section = profileSections + id;
+
+  if (interruptFreeTimingActive)
+  {
+    return;
+  }
+
+  ticks -= section->start;
+  ticks = ticks > profileOverhead ? ticks - profileOverhead : 0;
+
+  section->count++;
+  section->totalTicks += ticks;
+
+  if (ticks > section->maxTicks)
+  {
+    section->maxTicks = ticks;
+  }
+}
+
+
+// Measures the mean time taken by an empty section. Must be called after
+// installing the timer.
+static void CalibrateProfiler(void)
+{
+  ProfileSection* section = profileSections + PROFILE_CALIBRATION;
+  int i;
+
+  profileOverhead = 0;
+
+  for (i = 0; i < 1000; i++)
+  {
+    PROFILE_BEGIN(PROFILE_CALIBRATION);
+    PROFILE_END(PROFILE_CALIBRATION);
+  }
+
+  profileOverhead = section->totalTicks / section->count;
+  memset(section, 0, sizeof(ProfileSection));
+}
+
+
+static void PrintProfile(void)
+{
+  const float usPerTick = 1000000.0f / PIT_FREQUENCY;
+  int i;
+
+  printf(
+    "\nProfile (probe overhead of %.2f us subtracted):\n",
+    profileOverhead * usPerTick);
+  printf(
+    "  %-28s %8s %10s %10s %10s\n",
+    "section", "count", "total ms", "mean us", "max us");
+
+  for (i = 0; i < NUM_PROFILE_SECTIONS; i++)
+  {
+    const ProfileSection* section = profileSections + i;
+
+    if (section->count == 0)
+    {
+      continue;
+    }
+
+    printf(
+      "  %-28s %8lu %10.2f %10.2f %10.2f\n",
+      PROFILE_SECTION_NAMES[i],
+      section->count,
+      section->totalTicks * usPerTick / 1000.0f,
+      section->totalTicks * usPerTick / section->count,
+      section->maxTicks * usPerTick);
+  }
+}
+
+#else
+
+#define PROFILE_BEGIN(id)
+#define PROFILE_END(id)
+
+#endif
+
+
 /*******************************************************************************
 
   Drawing code
@@ -237,6 +774,15 @@ static int AdjustPaletteValue(int value)
 }
 
 
+static void SetDacEntry(int index, const char* rgb)
+{
+  outportb(0x3c8, index);
+  outportb(0x3c9, AdjustPaletteValue(rgb[0]));
+  outportb(0x3c9, AdjustPaletteValue(rgb[1]));
+  outportb(0x3c9, AdjustPaletteValue(rgb[2]));
+}
+
+
 static void SetDuke2Palette(void)
 {
   // See https://moddingwiki.shikadi.net/wiki/Duke_Nukem_II_Palette_Formats
@@ -249,12 +795,17 @@ static void SetDuke2Palette(void)
 
   int i;
 
+  // Mode 0xD's default attribute controller palette maps colors 8-15 to DAC
+  // entries 16-23, while in 256-color modes, colors index the DAC directly.
+  // Entries 8-15 aren't used in mode 0xD, so we can set up both at once.
   for (i = 0; i < 16; ++i)
   {
-    outportb(0x3c8, i <= 7 ? i : i + 8);
-    outportb(0x3c9, AdjustPaletteValue(PALETTE[i * 3 + 0]));
-    outportb(0x3c9, AdjustPaletteValue(PALETTE[i * 3 + 1]));
-    outportb(0x3c9, AdjustPaletteValue(PALETTE[i * 3 + 2]));
+    SetDacEntry(i, PALETTE + i * 3);
+
+    if (i > 7)
+    {
+      SetDacEntry(i + 8, PALETTE + i * 3);
+    }
   }
 }
 
@@ -267,6 +818,9 @@ static void CopyTilesToVram(byte *source, word size, word destOffset)
   byte *src = source;
   byte far *dest = MK_FP(VMEM_SEG, destOffset);
 
+  // The previous benchmark might have left latch copy mode enabled
+  EGA_SET_DEFAULT_MODE();
+
   for (i = 0; i < size; i++)
   {
     for (mask = 0x0100; mask < 0x1000; mask = mask << 1)
@@ -314,6 +868,42 @@ static void DrawSolidTile(word sourceOffset, word destOffset)
 }
 
 
+// Same as DrawSolidTile, but for a virtual screen width of SCROLL_PITCH
+// bytes instead of 40, as used for hardware scrolling.
+#define SCROLL_PITCH 42
+
+static void DrawSolidTileScroll(word sourceOffset, word destOffset)
+{
+  asm push  ds
+
+  asm mov   dx,VMEM_SEG
+  asm mov   es,dx
+  asm mov   dx,VMEM_TILES_SEG
+  asm mov   ds,dx
+  asm mov   si,[sourceOffset]
+  asm mov   di,[destOffset]
+  asm mov   bx, SCROLL_PITCH - 1
+
+  asm movsb
+  asm add   di,bx
+  asm movsb
+  asm add   di,bx
+  asm movsb
+  asm add   di,bx
+  asm movsb
+  asm add   di,bx
+  asm movsb
+  asm add   di,bx
+  asm movsb
+  asm add   di,bx
+  asm movsb
+  asm add   di,bx
+  asm movsb
+
+  asm pop   ds
+}
+
+
 // This code is very similar to how Duke Nukem II draws masked tiles, except
 // that it doesn't have to deal with the mask.
 //
@@ -387,230 +977,5675 @@ static void DrawSolidTileSlow(char near* data, word destOffset)
 }
 
 
-static void DrawFullscreen(char near* buffer)
+// Wide tiles: Blocks of 2 or 4 horizontally adjacent tiles, which can be
+// drawn using word or dword moves. The source layout is the same as for
+// DrawSolidTileSlow, i.e. row by row, with each row containing all 4 planes,
+// except that each plane has 2 or 4 bytes per row.
+//
+// Rearranges tile data in the format used by DrawSolidTileSlow into blocks of
+// tilesPerBlock (2 or 4) tiles.
+static void MakeWideTiles(byte* data, word numTiles, int tilesPerBlock)
+{
+  byte block[4 * 32];
+  word i;
+  int tile;
+  int row;
+  int plane;
+
+  for (i = 0; i < numTiles; i += tilesPerBlock)
+  {
+    for (tile = 0; tile < tilesPerBlock; tile++)
+    {
+      for (row = 0; row < 8; row++)
+      {
+        for (plane = 0; plane < 4; plane++)
+        {
+          block[(row * 4 + plane) * tilesPerBlock + tile] =
+            data[tile * 32 + row * 4 + plane];
+        }
+      }
+    }
+
+    memcpy(data, block, tilesPerBlock * 32);
+    data += tilesPerBlock * 32;
+  }
+}
+
+
+// Like DrawSolidTileSlow, but for 16 pixel wide blocks using movsw. Each row
+// of the destination is 40 bytes, each row of the source 8 bytes.
+static void DrawSolidTileSlow16(char near* data, word destOffset)
 {
-  asm mov si, [buffer]
-  asm xor di, di
+  asm mov di, [destOffset]
   asm mov ax, VMEM_SEG
+  asm mov si, [data]
   asm mov es, ax
-  asm mov bx, 4000
+
+  asm mov bx, 38
+  asm mov cx, 6
+
+#define COPY_BLOCK_16() asm { \
+  movsw;      \
+  add di,bx;  \
+  add si,cx;  \
+  movsw;      \
+  add di,bx;  \
+  add si,cx;  \
+  movsw;      \
+  add di,bx;  \
+  add si,cx;  \
+  movsw;      \
+  add di,bx;  \
+  add si,cx;  \
+  movsw;      \
+  add di,bx;  \
+  add si,cx;  \
+  movsw;      \
+  add di,bx;  \
+  add si,cx;  \
+  movsw;      \
+  add di,bx;  \
+  add si,cx;  \
+  movsw;      \
+}
+
+// 7 * 38 + 16 = 282 for the destination, 7 * 6 + 16 = 58 for the source,
+// minus 2 to get to the next plane.
+#define RESET_16() asm { \
+  sub di,282; \
+  sub si,56;  \
+}
+
+  EGA_SELECT_PLANE_0();
+  COPY_BLOCK_16();
+  RESET_16();
+
+  EGA_SELECT_PLANE_1();
+  COPY_BLOCK_16();
+  RESET_16();
+
+  EGA_SELECT_PLANE_2();
+  COPY_BLOCK_16();
+  RESET_16();
+
+  EGA_SELECT_PLANE_3();
+  COPY_BLOCK_16();
+}
+
+
+// Like DrawSolidTileSlow, but for 32 pixel wide blocks using movsd, which is
+// only available on the 386 and newer. Each row of the destination is 40
+// bytes, each row of the source 16 bytes.
+//
+// The inline assembler doesn't know about 386 instructions, so the operand
+// size prefix (0x66) is emitted manually to turn movsw into movsd.
+static void DrawSolidTileSlow32(char near* data, word destOffset)
+{
+  asm mov di, [destOffset]
+  asm mov ax, VMEM_SEG
+  asm mov si, [data]
+  asm mov es, ax
+
+  asm mov bx, 36
+  asm mov cx, 12
+
+#define MOVSD() asm { \
+  db 0x66;    \
+  movsw;      \
+}
+
+#define COPY_BLOCK_32() \
+  MOVSD();                            \
+  asm { add di,bx; add si,cx; }       \
+  MOVSD();                            \
+  asm { add di,bx; add si,cx; }       \
+  MOVSD();                            \
+  asm { add di,bx; add si,cx; }       \
+  MOVSD();                            \
+  asm { add di,bx; add si,cx; }       \
+  MOVSD();                            \
+  asm { add di,bx; add si,cx; }       \
+  MOVSD();                            \
+  asm { add di,bx; add si,cx; }       \
+  MOVSD();                            \
+  asm { add di,bx; add si,cx; }       \
+  MOVSD();
+
+// 7 * 36 + 32 = 284 for the destination, 7 * 12 + 32 = 116 for the source,
+// minus 4 to get to the next plane.
+#define RESET_32() asm { \
+  sub di,284; \
+  sub si,112; \
+}
+
+  EGA_SELECT_PLANE_0();
+  COPY_BLOCK_32();
+  RESET_32();
+
+  EGA_SELECT_PLANE_1();
+  COPY_BLOCK_32();
+  RESET_32();
+
+  EGA_SELECT_PLANE_2();
+  COPY_BLOCK_32();
+  RESET_32();
+
+  EGA_SELECT_PLANE_3();
+  COPY_BLOCK_32();
+}
+
+
+// Metatiles: Square blocks of 2x2 or 4x4 tiles, drawn by kernels which are
+// generated for a specific size by the macros below. widthBytes is the width
+// in bytes (8 pixel units), height the height in pixels. The latch-copy
+// variants take metatiles stored in the tile storage in video memory, one row
+// after another like for DrawSolidTile. The slow variants take data in the
+// layout used by MakeWideTiles, i.e. row by row, with each row containing
+// widthBytes bytes for each of the 4 planes.
+
+// The argument is a function-like macro, so that it's only expanded after
+// substitution
+#define REPEAT_8(x)  x() x() x() x() x() x() x() x()
+#define REPEAT_16(x) REPEAT_8(x) REPEAT_8(x)
+#define REPEAT_32(x) REPEAT_16(x) REPEAT_16(x)
+
+// Latch copies need to be done one byte at a time, since the latches only
+// hold the most recently read byte.
+#define LATCH_ROW_2() asm { movsb; movsb; add di,bx; }
+#define LATCH_ROW_4() asm { movsb; movsb; movsb; movsb; add di,bx; }
+
+#define DEFINE_DRAW_SOLID_METATILE(name, widthBytes, height) \
+static void name(word sourceOffset, word destOffset) \
+{                                      \
+  asm {                                \
+    push  ds;                          \
+    mov   dx,VMEM_SEG;                 \
+    mov   es,dx;                       \
+    mov   dx,VMEM_TILES_SEG;           \
+    mov   ds,dx;                       \
+    mov   si,[sourceOffset];           \
+    mov   di,[destOffset];             \
+    mov   bx,40 - widthBytes;          \
+  }                                    \
+                                       \
+  REPEAT_##height(LATCH_ROW_##widthBytes) \
+                                       \
+  asm { pop ds; }                      \
+}
+
+DEFINE_DRAW_SOLID_METATILE(DrawSolidMetatile16, 2, 16)
+DEFINE_DRAW_SOLID_METATILE(DrawSolidMetatile32, 4, 32)
+
+
+// Copies one row of one plane, then advances both pointers to the next row.
+// BX and CX hold the remainder of the destination and source row sizes.
+#define SLOW_ROW_2() asm { movsw; add di,bx; add si,cx; }
+#define SLOW_ROW_4() asm { movsw; movsw; add di,bx; add si,cx; }
+
+// Back to the first row of the destination, and the first row's next plane
+// in the source
+#define SLOW_RESET(widthBytes, height) asm { \
+  sub di,40 * height;                   \
+  sub si,4 * widthBytes * height - widthBytes; \
+}
+
+#define DEFINE_DRAW_SOLID_METATILE_SLOW(name, widthBytes, height) \
+static void name(const byte far* data, word destOffset) \
+{                                      \
+  asm {                                \
+    push  ds;                          \
+    mov   di,[destOffset];             \
+    mov   ax,VMEM_SEG;                 \
+    mov   es,ax;                       \
+    lds   si,[data];                   \
+    mov   bx,40 - widthBytes;          \
+    mov   cx,3 * widthBytes;           \
+  }                                    \
+                                       \
+  EGA_SELECT_PLANE_0();                \
+  REPEAT_##height(SLOW_ROW_##widthBytes) \
+  SLOW_RESET(widthBytes, height);      \
+                                       \
+  EGA_SELECT_PLANE_1();                \
+  REPEAT_##height(SLOW_ROW_##widthBytes) \
+  SLOW_RESET(widthBytes, height);      \
+                                       \
+  EGA_SELECT_PLANE_2();                \
+  REPEAT_##height(SLOW_ROW_##widthBytes) \
+  SLOW_RESET(widthBytes, height);      \
+                                       \
+  EGA_SELECT_PLANE_3();                \
+  REPEAT_##height(SLOW_ROW_##widthBytes) \
+                                       \
+  asm { pop ds; }                      \
+}
+
+DEFINE_DRAW_SOLID_METATILE_SLOW(DrawSolidMetatileSlow16, 2, 16)
+DEFINE_DRAW_SOLID_METATILE_SLOW(DrawSolidMetatileSlow32, 4, 32)
+
+
+// Compiled tiles: Straight-line code generated for a specific tile, which
+// writes the tile's pixels as immediate values, without reading any source
+// data. The code expects the destination in ES:DI, and returns via retf.
+#define COMPILED_TILE_MAX_BYTES (3 + 4 * (4 + 8 * 6) + 1)
+
+// Generates code for the given tile (in the format used by DrawSolidTileSlow)
+// and returns its size in bytes.
+static word CompileTile(const byte* tile, byte far* code)
+{
+  byte far* out = code;
+  word offset;
+  int plane;
+  int row;
+
+  // mov dx, 0x3c4
+  *out++ = 0xBA;
+  *out++ = 0xC4;
+  *out++ = 0x03;
+
+  for (plane = 0; plane < 4; plane++)
+  {
+    // mov ax, <map mask for plane>
+    // out dx, ax
+    *out++ = 0xB8;
+    *out++ = 0x02;
+    *out++ = 1 << plane;
+    *out++ = 0xEF;
+
+    for (row = 0; row < 8; row++)
+    {
+      offset = row * 40;
+
+      // mov byte ptr es:[di + offset], <value>
+      *out++ = 0x26;
+      *out++ = 0xC6;
+
+      if (offset < 0x80)
+      {
+        *out++ = 0x45;
+        *out++ = (byte)offset;
+      }
+      else
+      {
+        *out++ = 0x85;
+        *out++ = (byte)offset;
+        *out++ = (byte)(offset >> 8);
+      }
+
+      *out++ = tile[row * 4 + plane];
+    }
+  }
+
+  // retf
+  *out++ = 0xCB;
+
+  return (word)(out - code);
+}
+
+
+static void DrawCompiledTile(byte far* code, word destOffset)
+{
+  asm mov di, [destOffset]
+  asm mov ax, VMEM_SEG
+  asm mov es, ax
+  asm call dword ptr [code]
+}
+
+
+// Plane-major tiles: All tiles' data for plane 0, followed by all data for
+// plane 1, etc. Within a plane, each tile's 8 rows are stored consecutively,
+// i.e. the layout matches that of the latch-copy tile storage in video memory.
+//
+// Rearranges tile data in the format used by DrawSolidTileSlow into
+// plane-major order. Returns 0 if there is not enough memory.
+static int MakePlaneMajorTiles(byte* data, word numTiles)
+{
+  byte far* temp = farmalloc(numTiles * 32L);
+  word tile;
+  int row;
+  int plane;
+
+  if (!temp)
+  {
+    return 0;
+  }
+
+  _fmemcpy(temp, data, numTiles * 32);
+
+  for (tile = 0; tile < numTiles; tile++)
+  {
+    for (row = 0; row < 8; row++)
+    {
+      for (plane = 0; plane < 4; plane++)
+      {
+        data[plane * numTiles * 8 + tile * 8 + row] =
+          temp[tile * 32 + row * 4 + plane];
+      }
+    }
+  }
+
+  farfree(temp);
+  return 1;
+}
+
+
+// Converts a single tile from the format used by DrawSolidTileSlow into
+// planar format: 8 bytes for plane 0, followed by 8 bytes for plane 1 etc.
+// This matches the layout of a tile in the latch-copy tile storage, one plane
+// at a time.
+static void MakePlanarTile(const byte* src, byte far* dest)
+{
+  int row;
+  int plane;
+
+  for (row = 0; row < 8; row++)
+  {
+    for (plane = 0; plane < 4; plane++)
+    {
+      dest[plane * 8 + row] = src[row * 4 + plane];
+    }
+  }
+}
+
+
+// Uploads plane-major data, i.e. size bytes for plane 0, followed by size bytes
+// for plane 1 etc., to video memory. Unlike CopyTilesToVram, this selects each
+// plane only once, and copies the data using rep movsw. Requires write mode 0.
+static void UploadPlanarToVram(const byte* source, word size, word destOffset)
+{
+  asm mov   si,[source]
+  asm mov   bx,[size]
+  asm mov   ax,VMEM_SEG
+  asm mov   es,ax
+
+// The carry flag is set by shr if size is odd. movsw leaves the flags alone,
+// so adc turns cx into 1 for the remaining byte in that case.
+#define UPLOAD_PLANE() asm { \
+  mov di,[destOffset]; \
+  mov cx,bx;           \
+  shr cx,1;            \
+  rep movsw;           \
+  adc cx,cx;           \
+  rep movsb;           \
+}
+
+  EGA_SELECT_PLANE_0();
+  UPLOAD_PLANE();
+
+  EGA_SELECT_PLANE_1();
+  UPLOAD_PLANE();
+
+  EGA_SELECT_PLANE_2();
+  UPLOAD_PLANE();
+
+  EGA_SELECT_PLANE_3();
+  UPLOAD_PLANE();
+}
+
+
+// Draws numRows rows of 40 tiles each from plane-major tile data into the
+// currently selected plane(s). data points to the first tile's data within
+// the plane.
+static void DrawTilePlaneRows(char near* data, word destOffset, word numRows)
+{
+  asm mov si, [data]
+  asm mov di, [destOffset]
+  asm mov ax, VMEM_SEG
+  asm mov es, ax
+  asm mov dx, [numRows]
+  asm mov bx, 39
+
+nextRow:
+  asm mov cx, 40
+
+nextTile:
+  asm movsb
+  asm add   di,bx
+  asm movsb
+  asm add   di,bx
+  asm movsb
+  asm add   di,bx
+  asm movsb
+  asm add   di,bx
+  asm movsb
+  asm add   di,bx
+  asm movsb
+  asm add   di,bx
+  asm movsb
+  asm add   di,bx
+  asm movsb
+
+  // Back to the top of the tile, one column to the right: 7 * 39 + 8 - 1
+  asm sub   di,280
+  asm loop  nextTile
+
+  // 40 bytes into the tile row at this point, advance to the next one
+  asm add   di,280
+  asm dec   dx
+  asm jnz   nextRow
+}
+
+
+// Masked tiles use the format of Duke Nukem II's masked tiles: 8 rows of 5
+// bytes each, the mask followed by the 4 planes. Set bits in the mask mark
+// transparent pixels.
+#define MASKED_TILE_BYTES 40
+
+// Combines one row of one plane of a masked tile with what's already in video
+// memory. The currently selected read map determines which plane is read.
+#define MASK_ROW(row, plane) asm { \
+  mov al, es:[di + row * 40];               \
+  and al, [si + row * 5];                   \
+  or  al, [si + row * 5 + 1 + plane];       \
+  mov es:[di + row * 40], al;               \
+}
+
+#define MASK_PLANE(plane) \
+  MASK_ROW(0, plane)      \
+  MASK_ROW(1, plane)      \
+  MASK_ROW(2, plane)      \
+  MASK_ROW(3, plane)      \
+  MASK_ROW(4, plane)      \
+  MASK_ROW(5, plane)      \
+  MASK_ROW(6, plane)      \
+  MASK_ROW(7, plane)
+
+// Draws a masked tile from main memory, doing a read-modify-write of each
+// plane. This requires write mode 0 and the default bit mask.
+static void DrawMaskedTile(byte near* data, word destOffset)
+{
+  asm mov di, [destOffset]
+  asm mov ax, VMEM_SEG
+  asm mov si, [data]
+  asm mov es, ax
+
+  EGA_SELECT_PLANE_0();
+  MASK_PLANE(0);
+
+  EGA_SELECT_PLANE_1();
+  MASK_PLANE(1);
+
+  EGA_SELECT_PLANE_2();
+  MASK_PLANE(2);
+
+  EGA_SELECT_PLANE_3();
+  MASK_PLANE(3);
+}
+
+
+static void DrawFullscreen(char near* buffer, word destOffset)
+{
+  asm mov si, [buffer]
+  asm mov di, [destOffset]
+  asm mov ax, VMEM_SEG
+  asm mov es, ax
+  asm mov bx, 4000
 
   EGA_SELECT_PLANE_0();
   asm mov cx, bx
   asm rep movsw
 
-  EGA_SELECT_PLANE_1();
-  asm xor di, di
-  asm mov cx, bx
-  asm rep movsw
+  EGA_SELECT_PLANE_1();
+  asm mov di, [destOffset]
+  asm mov cx, bx
+  asm rep movsw
+
+  EGA_SELECT_PLANE_2();
+  asm mov di, [destOffset]
+  asm mov cx, bx
+  asm rep movsw
+
+  EGA_SELECT_PLANE_3();
+  asm mov di, [destOffset]
+  asm mov cx, bx
+  asm rep movsw
+}
+
+
+static void DrawTiledFullscreen(word destOffset)
+{
+  int col;
+  word row;
+  int idx = 0;
+
+  EGA_SETUP_LATCH_COPY();
+
+  for (row = destOffset; row < destOffset + 25 * 320; row += 320)
+  {
+    for (col = 0; col < 40; col++)
+    {
+      DrawSolidTile(idx, col + row);
+      idx += 8;
+    }
+  }
+}
+
+
+static void DrawTiledFullscreenSlow(char near* buffer, word destOffset)
+{
+  int col;
+  word row;
+
+  EGA_SET_DEFAULT_MODE();
+
+  for (row = destOffset; row < destOffset + 25 * 320; row += 320)
+  {
+    for (col = 0; col < 40; col++)
+    {
+      DrawSolidTileSlow(buffer, col + row);
+      buffer += 32;
+    }
+  }
+}
+
+
+static void DrawTiledFullscreenSlow16(char near* buffer)
+{
+  int col;
+  int row;
+
+  EGA_SET_DEFAULT_MODE();
+
+  for (row = 0; row < 25 * 320; row += 320)
+  {
+    for (col = 0; col < 40; col += 2)
+    {
+      DrawSolidTileSlow16(buffer, col + row);
+      buffer += 64;
+    }
+  }
+}
+
+
+static void DrawTiledFullscreenSlow32(char near* buffer)
+{
+  int col;
+  int row;
+
+  EGA_SET_DEFAULT_MODE();
+
+  for (row = 0; row < 25 * 320; row += 320)
+  {
+    for (col = 0; col < 40; col += 4)
+    {
+      DrawSolidTileSlow32(buffer, col + row);
+      buffer += 128;
+    }
+  }
+}
+
+
+// Draws a screen full of tiles from plane-major data, selecting each plane only
+// once per frame.
+static void DrawTiledFullscreenBatched(char near* buffer)
+{
+  EGA_SET_DEFAULT_MODE();
+
+  EGA_SELECT_PLANE_0();
+  DrawTilePlaneRows(buffer, 0, 25);
+
+  EGA_SELECT_PLANE_1();
+  DrawTilePlaneRows(buffer + 8000, 0, 25);
+
+  EGA_SELECT_PLANE_2();
+  DrawTilePlaneRows(buffer + 16000, 0, 25);
+
+  EGA_SELECT_PLANE_3();
+  DrawTilePlaneRows(buffer + 24000, 0, 25);
+}
+
+
+// Same as above, but selecting each plane once per row of tiles
+static void DrawTiledFullscreenBatchedRows(char near* buffer)
+{
+  word row;
+
+  EGA_SET_DEFAULT_MODE();
+
+  for (row = 0; row < 25 * 320; row += 320)
+  {
+    PROFILE_BEGIN(PROFILE_PLANE_SELECT);
+    EGA_SELECT_PLANE_0();
+    PROFILE_END(PROFILE_PLANE_SELECT);
+
+    PROFILE_BEGIN(PROFILE_PLANE_ROWS);
+    DrawTilePlaneRows(buffer, row, 1);
+    PROFILE_END(PROFILE_PLANE_ROWS);
+
+    PROFILE_BEGIN(PROFILE_PLANE_SELECT);
+    EGA_SELECT_PLANE_1();
+    PROFILE_END(PROFILE_PLANE_SELECT);
+
+    PROFILE_BEGIN(PROFILE_PLANE_ROWS);
+    DrawTilePlaneRows(buffer + 8000, row, 1);
+    PROFILE_END(PROFILE_PLANE_ROWS);
+
+    PROFILE_BEGIN(PROFILE_PLANE_SELECT);
+    EGA_SELECT_PLANE_2();
+    PROFILE_END(PROFILE_PLANE_SELECT);
+
+    PROFILE_BEGIN(PROFILE_PLANE_ROWS);
+    DrawTilePlaneRows(buffer + 16000, row, 1);
+    PROFILE_END(PROFILE_PLANE_ROWS);
+
+    PROFILE_BEGIN(PROFILE_PLANE_SELECT);
+    EGA_SELECT_PLANE_3();
+    PROFILE_END(PROFILE_PLANE_SELECT);
+
+    PROFILE_BEGIN(PROFILE_PLANE_ROWS);
+    DrawTilePlaneRows(buffer + 24000, row, 1);
+    PROFILE_END(PROFILE_PLANE_ROWS);
+
+    buffer += 320;
+  }
+}
+
+
+// Copies a full-screen image in the same format as used by DrawFullscreen to
+// the given offset in video memory. Not optimized, meant for setup only.
+static void CopyImageToVram(const byte* image, word destOffset)
+{
+  int plane;
+
+  EGA_SET_DEFAULT_MODE();
+
+  for (plane = 0; plane < 4; plane++)
+  {
+    outport(0x03c4, (0x100 << plane) | 0x02);
+    _fmemcpy(MK_FP(VMEM_SEG, destOffset), image + plane * 8000, 8000);
+  }
+}
+
+
+// Copies count bytes within video memory via latch copy, i.e. all 4 planes at
+// once. Latch copy mode must be set up already.
+static void LatchCopy(word sourceOffset, word destOffset, word count)
+{
+  asm push  ds
+
+  asm mov   si,[sourceOffset]
+  asm mov   di,[destOffset]
+  asm mov   cx,[count]
+  asm mov   ax,VMEM_SEG
+  asm mov   es,ax
+  asm mov   ds,ax
+  asm rep   movsb
+
+  asm pop   ds
+}
+
+
+// Latch-copies a horizontal span of tiles from a tile sheet, i.e. tiles laid
+// out next to each other with a pitch of 40 bytes, using one rep movsb per
+// line. Latch copy mode must be set up already.
+static void CopyTileSpan(word sourceOffset, word destOffset, word length)
+{
+  asm push  ds
+
+  asm mov   si,[sourceOffset]
+  asm mov   di,[destOffset]
+  asm mov   bx,[length]
+  asm mov   dx,40
+  asm sub   dx,bx
+  asm mov   ax,VMEM_SEG
+  asm mov   es,ax
+  asm mov   ds,ax
+  asm mov   al,8
+
+nextLine:
+  asm mov   cx,bx
+  asm rep   movsb
+  asm add   si,dx
+  asm add   di,dx
+  asm dec   al
+  asm jnz   nextLine
+
+  asm pop   ds
+}
+
+
+// Fills a horizontal span with copies of a single tile from a tile sheet.
+// Reading a byte of the tile loads the latches, and in write mode 1, the
+// latches are then written to each byte of the line by rep stosb, regardless
+// of the value in AL. Latch copy mode must be set up already.
+static void FillTileSpan(word sourceOffset, word destOffset, word length)
+{
+  asm push  ds
+
+  asm mov   si,[sourceOffset]
+  asm mov   di,[destOffset]
+  asm mov   bx,[length]
+  asm mov   dx,40
+  asm sub   dx,bx
+  asm mov   ax,VMEM_SEG
+  asm mov   es,ax
+  asm mov   ds,ax
+  asm mov   ah,8
+
+nextLine:
+  asm mov   al,[si]
+  asm mov   cx,bx
+  asm rep   stosb
+  asm add   si,40
+  asm add   di,dx
+  asm dec   ah
+  asm jnz   nextLine
+
+  asm pop   ds
+}
+
+
+// Latch-copies a full-screen image, rotated to the left by the given number
+// of bytes, with the part that's shifted out appearing on the right. Latch
+// copy mode must be set up already.
+static void DrawWrappedBackdrop(
+  word sourceOffset,
+  word destOffset,
+  word shift)
+{
+  asm push  ds
+
+  asm mov   si,[sourceOffset]
+  asm mov   di,[destOffset]
+  asm mov   bx,[shift]
+  asm mov   ax,VMEM_SEG
+  asm mov   es,ax
+  asm mov   ds,ax
+  asm mov   dx,200
+
+nextLine:
+  // From the shift position to the end of the source line
+  asm add   si,bx
+  asm mov   cx,40
+  asm sub   cx,bx
+  asm rep   movsb
+
+  // From the start of the source line to the shift position
+  asm sub   si,40
+  asm mov   cx,bx
+  asm rep   movsb
+
+  // SI is at the shift position again
+  asm sub   si,bx
+  asm add   si,40
+  asm dec   dx
+  asm jnz   nextLine
+
+  asm pop   ds
+}
+
+
+static void ClearScreen(void)
+{
+  int i;
+
+  outport(0x03c4, (0x0f << 8) | 0x02);  /* map mask: all planes active */
+
+  for (i = 0; i < 8000; i++)
+  {
+    VMEM[i] = 0;
+  }
+}
+
+
+/*******************************************************************************
+
+  Tile maps
+
+*******************************************************************************/
+
+// Tile indices for each cell of a 40x25 screen. Tile n is stored at offset
+// n * 8 in the latch-copy tile storage at VMEM_TILES_SEG.
+static word tileMap[MAP_CELLS];
+
+static dword randomState = 1;
+
+
+static void SeedRandom(dword seed)
+{
+  randomState = seed;
+}
+
+
+static word Random(void)
+{
+  randomState = randomState * 1103515245L + 12345;
+  return (word)(randomState >> 16) & 0x7fff;
+}
+
+
+static void InitLinearTileMap(void)
+{
+  int i;
+
+  for (i = 0; i < MAP_CELLS; i++)
+  {
+    tileMap[i] = i;
+  }
+}
+
+
+// Fills the map with horizontal runs of 1 to 16 cells, each using one of
+// only 8 different tiles. This resembles typical level maps, where large
+// areas are made up of a few background tiles.
+static void InitRepeatingTileMap(void)
+{
+  word tiles[8];
+  int i;
+  int cell = 0;
+
+  for (i = 0; i < 8; i++)
+  {
+    tiles[i] = Random() % MAP_CELLS;
+  }
+
+  while (cell < MAP_CELLS)
+  {
+    word tile = tiles[Random() % 8];
+    int runLength = 1 + Random() % 16;
+
+    for (i = 0; i < runLength && cell < MAP_CELLS; i++)
+    {
+      tileMap[cell++] = tile;
+    }
+  }
+}
+
+
+static void InitRandomTileMap(void)
+{
+  int i;
+
+  for (i = 0; i < MAP_CELLS; i++)
+  {
+    tileMap[i] = Random() % MAP_CELLS;
+  }
+}
+
+
+// Fills the map with runs of 1 to maxRun cells, which randomly either repeat a
+// single tile or consist of consecutive tiles (n, n + 1, ...), as found in
+// maps built from larger objects made up of several tiles.
+static void InitRunLengthTileMap(int maxRun)
+{
+  int i;
+  int cell = 0;
+
+  while (cell < MAP_CELLS)
+  {
+    word tile = Random() % MAP_CELLS;
+    int runLength = 1 + Random() % maxRun;
+    int step = Random() & 1;
+
+    for (i = 0; i < runLength && cell < MAP_CELLS; i++)
+    {
+      tileMap[cell++] = tile;
+      tile = (tile + step) % MAP_CELLS;
+    }
+  }
+}
+
+
+// Loads a map from a file containing one 16-bit tile index per cell
+static int LoadTileMap(const char* filename)
+{
+  FILE* fp = fopen(filename, "rb");
+  size_t cellsRead;
+  int i;
+
+  if (!fp)
+  {
+    return 0;
+  }
+
+  cellsRead = fread(tileMap, sizeof(word), MAP_CELLS, fp);
+  fclose(fp);
+
+  // A truncated file would leave part of the previous map in place
+  if (cellsRead != MAP_CELLS)
+  {
+    return 0;
+  }
+
+  for (i = 0; i < MAP_CELLS; i++)
+  {
+    tileMap[i] %= MAP_CELLS;
+  }
+
+  return 1;
+}
+
+
+// Draws the tile map from tile data in main memory, in the format used by
+// DrawSolidTileSlow
+static void DrawTileMapSlow(char near* tiles)
+{
+  int col;
+  int row;
+  int cell = 0;
+
+  EGA_SET_DEFAULT_MODE();
+
+  for (row = 0; row < 25 * 320; row += 320)
+  {
+    for (col = 0; col < 40; col++, cell++)
+    {
+      DrawSolidTileSlow(tiles + tileMap[cell] * 32, col + row);
+    }
+  }
+}
+
+
+// Draws the tile map using compiled tiles. The code for all tiles must be
+// located in the same segment as code, tileOffsets gives the offset of each
+// tile's code within that segment.
+static void DrawCompiledTileMap(byte far* code, const word* tileOffsets)
+{
+  word codeSegment = FP_SEG(code);
+  int col;
+  int row;
+  int cell = 0;
+
+  EGA_SET_DEFAULT_MODE();
+
+  for (row = 0; row < 25 * 320; row += 320)
+  {
+    for (col = 0; col < 40; col++, cell++)
+    {
+      DrawCompiledTile(
+        MK_FP(codeSegment, tileOffsets[tileMap[cell]]), col + row);
+    }
+  }
+}
+
+
+// Draws numRows rows of 40 tiles each via latch copy, taking tile indices from
+// tiles (in the same format as tileMap). Unlike DrawTileMap, this sets up the
+// segment registers once, and has no per-tile function call overhead. Latch
+// copy mode must be set up already.
+static void DrawTileRowsLatch(const word near* tiles, word destOffset, word numRows)
+{
+  asm push  ds
+
+  asm mov   bx,[tiles]
+  asm mov   di,[destOffset]
+  asm mov   dx,[numRows]
+  asm mov   ax,VMEM_SEG
+  asm mov   es,ax
+  asm mov   ax,VMEM_TILES_SEG
+  asm mov   ds,ax
+  asm mov   ax,39
+
+nextRow:
+  asm mov   cx,40
+
+nextTile:
+  // DS points to video memory now, but the tile indices are in the data
+  // segment, which SS also points to in the small memory model
+  asm mov   si,ss:[bx]
+  asm add   bx,2
+  asm shl   si,1
+  asm shl   si,1
+  asm shl   si,1
+
+  asm movsb
+  asm add   di,ax
+  asm movsb
+  asm add   di,ax
+  asm movsb
+  asm add   di,ax
+  asm movsb
+  asm add   di,ax
+  asm movsb
+  asm add   di,ax
+  asm movsb
+  asm add   di,ax
+  asm movsb
+  asm add   di,ax
+  asm movsb
+
+  // Back to the top of the tile, one column to the right: 7 * 39 + 8 - 1
+  asm sub   di,280
+  asm loop  nextTile
+
+  // 40 bytes into the tile row at this point, advance to the next one
+  asm add   di,280
+  asm dec   dx
+  asm jnz   nextRow
+
+  asm pop   ds
+}
+
+
+// Hardware scrolling: The tile map is repeated infinitely in both directions,
+// and drawn onto a virtual screen with a width of SCROLL_PITCH bytes,
+// starting at offset 0. When the start address advances by one byte (8
+// pixels) or one line, only the newly exposed column or row of tiles needs to
+// be drawn. The virtual screen is wider than the visible 40 bytes, because
+// with pel panning, part of a 41st column becomes visible.
+static void DrawScrollTile(word col, word row)
+{
+  word tile = tileMap[(row % MAP_HEIGHT) * MAP_WIDTH + col % MAP_WIDTH];
+
+  DrawSolidTileScroll(tile << 3, col + row * (8 * SCROLL_PITCH));
+}
+
+
+// Top row is given in tiles. Draws the 25 visible rows plus the one that
+// becomes partially visible when scrolling vertically.
+static void DrawScrollColumn(word col, word topRow)
+{
+  word row;
+
+  for (row = topRow; row < topRow + MAP_HEIGHT + 1; row++)
+  {
+    DrawScrollTile(col, row);
+  }
+}
+
+
+// Left column is given in tiles. Draws the 40 visible columns plus the one
+// that becomes partially visible due to pel panning.
+static void DrawScrollRow(word leftCol, word row)
+{
+  word col;
+
+  for (col = leftCol; col < leftCol + MAP_WIDTH + 1; col++)
+  {
+    DrawScrollTile(col, row);
+  }
+}
+
+
+static void DrawTileMap(word pageOffset)
+{
+  int col;
+  int row;
+  int cell = 0;
+
+  EGA_SETUP_LATCH_COPY();
+
+  for (row = 0; row < 25 * 320; row += 320)
+  {
+    for (col = 0; col < 40; col++, cell++)
+    {
+      DrawSolidTile(tileMap[cell] << 3, pageOffset + col + row);
+    }
+  }
+}
+
+
+// Tile spans: The tile map is preprocessed into horizontal spans, each being
+// either a run of identical tiles (drawn via FillTileSpan) or of consecutive
+// tiles that are adjacent in video memory (drawn via CopyTileSpan). For the
+// latter, the tiles are arranged as a 320x200 tile sheet, with tile n at
+// column n % 40 and row n / 40. Spans never cross a row of the map.
+#define TILE_SHEET_SIZE (MAP_CELLS * 8)
+
+typedef struct
+{
+  // Offset of the first tile's top line in the tile sheet
+  word sourceOffset;
+
+  // Offset relative to the start of the page
+  word destOffset;
+
+  byte length;
+  byte fill;
+} TileSpan;
+
+// Room for MAP_CELLS spans, allocated by the caller
+static TileSpan far* tileSpans;
+static int numTileSpans;
+
+
+// Latch-copies the tiles from the tile storage at VMEM_TILES_SEG into a tile
+// sheet at the given offset. Not optimized, meant for setup only.
+static void MakeTileSheet(word destOffset)
+{
+  word tile;
+  word line;
+
+  EGA_SETUP_LATCH_COPY();
+
+  for (tile = 0; tile < MAP_CELLS; tile++)
+  {
+    for (line = 0; line < 8; line++)
+    {
+      LatchCopy(
+        VMEM_TILES_OFFSET + tile * 8 + line,
+        destOffset + (tile / 40) * 320 + line * 40 + tile % 40,
+        1);
+    }
+  }
+
+  EGA_SET_DEFAULT_MODE();
+}
+
+
+// Builds the spans for the current tile map, using the tile sheet at the
+// given offset. When a run of identical tiles and one of consecutive tiles
+// start at the same cell, the longer one is used.
+static void BuildTileSpans(word sheetOffset)
+{
+  int row;
+  int col;
+  int length;
+
+  numTileSpans = 0;
+
+  for (row = 0; row < MAP_HEIGHT; row++)
+  {
+    for (col = 0; col < MAP_WIDTH; col += length)
+    {
+      const word* cells = tileMap + row * MAP_WIDTH + col;
+      TileSpan far* span = tileSpans + numTileSpans++;
+      word tile = cells[0];
+      int maxLength = MAP_WIDTH - col;
+      int same = 1;
+      int adjacent = 1;
+
+      while (same < maxLength && cells[same] == tile)
+      {
+        same++;
+      }
+
+      // Consecutive tiles are adjacent in the sheet only up to the end of the
+      // sheet's row
+      while (
+        adjacent < maxLength &&
+        cells[adjacent] == tile + adjacent &&
+        (tile + adjacent) % 40 != 0)
+      {
+        adjacent++;
+      }
+
+      span->fill = same > adjacent;
+      length = span->fill ? same : adjacent;
+
+      span->sourceOffset = sheetOffset + (tile / 40) * 320 + tile % 40;
+      span->destOffset = row * 320 + col;
+      span->length = length;
+    }
+  }
+}
+
+
+static void DrawTileSpans(word pageOffset)
+{
+  const TileSpan far* span = tileSpans;
+  int i;
+
+  EGA_SETUP_LATCH_COPY();
+
+  for (i = 0; i < numTileSpans; i++, span++)
+  {
+    if (span->fill)
+    {
+      FillTileSpan(
+        span->sourceOffset, pageOffset + span->destOffset, span->length);
+    }
+    else
+    {
+      CopyTileSpan(
+        span->sourceOffset, pageOffset + span->destOffset, span->length);
+    }
+  }
+}
+
+
+// Assigns a different tile to the given number of randomly chosen cells,
+// simulating changes to the map or animated tiles.
+static void ChangeRandomTiles(int count)
+{
+  int i;
+
+  for (i = 0; i < count; i++)
+  {
+    word cell = Random() % MAP_CELLS;
+    tileMap[cell] = (tileMap[cell] + 1 + Random() % (MAP_CELLS - 1)) %
+      MAP_CELLS;
+  }
+}
+
+
+// Marks all cells as needing to be redrawn
+static void InvalidateDrawnTiles(word* drawnTiles)
+{
+  int i;
+
+  for (i = 0; i < MAP_CELLS; i++)
+  {
+    drawnTiles[i] = 0xFFFF;
+  }
+}
+
+
+// Draws only those cells of the tile map that differ from what's recorded
+// in drawnTiles as being on the page already, and updates drawnTiles
+// accordingly. Since each page needs to be brought up to date separately,
+// there must be one drawnTiles array per page. When the map view scrolls,
+// the affected cells naturally end up being redrawn, because their content
+// doesn't match anymore. Returns the number of cells drawn.
+static word DrawDirtyTiles(word* drawnTiles, word pageOffset)
+{
+  int col;
+  int row;
+  int cell = 0;
+  word count = 0;
+
+  EGA_SETUP_LATCH_COPY();
+
+  for (row = 0; row < 25 * 320; row += 320)
+  {
+    for (col = 0; col < 40; col++, cell++)
+    {
+      if (drawnTiles[cell] != tileMap[cell])
+      {
+        DrawSolidTile(tileMap[cell] << 3, pageOffset + col + row);
+        drawnTiles[cell] = tileMap[cell];
+        count++;
+      }
+    }
+  }
+
+  return count;
+}
+
+
+/*******************************************************************************
+
+  Tile cache
+
+  Maps tile IDs of a tileset in main memory, which can be larger than what fits
+  into video memory, to slots in the latch-copy tile storage. Tiles are
+  uploaded on demand, evicting the least recently used slot if necessary.
+  The slots form a doubly linked list in order of use, most recent first.
+
+*******************************************************************************/
+
+#define NO_SLOT 0xFFFF
+#define NO_TILE 0xFFFF
+
+typedef struct
+{
+  const byte far* tileset;  // in planar format, see MakePlanarTile
+  word numTiles;
+  word numSlots;
+
+  word* tileToSlot;
+  word* slotToTile;
+  word* prevSlot;
+  word* nextSlot;
+  word mostRecent;
+  word leastRecent;
+
+  dword hits;
+  dword misses;
+  dword uploadTicks;
+} TileCache;
+
+
+static int InitTileCache(
+  TileCache* cache,
+  const byte far* tileset,
+  word numTiles,
+  word numSlots)
+{
+  word i;
+
+  memset(cache, 0, sizeof(TileCache));
+  cache->tileset = tileset;
+  cache->numTiles = numTiles;
+  cache->numSlots = numSlots;
+
+  cache->tileToSlot = malloc(numTiles * sizeof(word));
+  cache->slotToTile = malloc(numSlots * sizeof(word));
+  cache->prevSlot = malloc(numSlots * sizeof(word));
+  cache->nextSlot = malloc(numSlots * sizeof(word));
+
+  if (
+    !cache->tileToSlot || !cache->slotToTile ||
+    !cache->prevSlot || !cache->nextSlot)
+  {
+    free(cache->tileToSlot);
+    free(cache->slotToTile);
+    free(cache->prevSlot);
+    free(cache->nextSlot);
+    return 0;
+  }
+
+  for (i = 0; i < numTiles; i++)
+  {
+    cache->tileToSlot[i] = NO_SLOT;
+  }
+
+  for (i = 0; i < numSlots; i++)
+  {
+    cache->slotToTile[i] = NO_TILE;
+    cache->prevSlot[i] = i - 1;
+    cache->nextSlot[i] = i + 1;
+  }
+
+  cache->prevSlot[0] = NO_SLOT;
+  cache->nextSlot[numSlots - 1] = NO_SLOT;
+  cache->mostRecent = 0;
+  cache->leastRecent = numSlots - 1;
+  return 1;
+}
+
+
+static void DestroyTileCache(TileCache* cache)
+{
+  free(cache->tileToSlot);
+  free(cache->slotToTile);
+  free(cache->prevSlot);
+  free(cache->nextSlot);
+}
+
+
+static void MarkSlotUsed(TileCache* cache, word slot)
+{
+  word prev = cache->prevSlot[slot];
+  word next = cache->nextSlot[slot];
+
+  if (slot == cache->mostRecent)
+  {
+    return;
+  }
+
+  // Unlink. Since the slot isn't the most recent one, prev is valid
+  cache->nextSlot[prev] = next;
+
+  if (next != NO_SLOT)
+  {
+    cache->prevSlot[next] = prev;
+  }
+  else
+  {
+    cache->leastRecent = prev;
+  }
+
+  // Insert at the front
+  cache->prevSlot[slot] = NO_SLOT;
+  cache->nextSlot[slot] = cache->mostRecent;
+  cache->prevSlot[cache->mostRecent] = slot;
+  cache->mostRecent = slot;
+}
+
+
+// Writes a single tile in planar format (see MakePlanarTile) to the tile
+// storage in video memory. Requires write mode 0.
+static void UploadTile(const byte far* tile, word destOffset)
+{
+  asm push  ds
+
+  asm mov   bx,[destOffset]
+  asm lds   si,[tile]
+  asm mov   ax,VMEM_SEG
+  asm mov   es,ax
+  asm mov   dx,0x3c4
+
+#define UPLOAD_TILE_PLANE(mapMask) asm { \
+  mov ax, mapMask; \
+  out dx, ax;      \
+  mov di, bx;      \
+  movsw;           \
+  movsw;           \
+  movsw;           \
+  movsw;           \
+}
+
+  UPLOAD_TILE_PLANE(0x102);
+  UPLOAD_TILE_PLANE(0x202);
+  UPLOAD_TILE_PLANE(0x402);
+  UPLOAD_TILE_PLANE(0x802);
+
+  asm pop   ds
+}
+
+
+// Returns the offset of the given tile within the tile storage, suitable for
+// passing to DrawSolidTile, uploading it first if necessary. Assumes latch
+// copy mode is active, and restores it after uploading.
+static word GetCachedTile(TileCache* cache, word tile)
+{
+  word slot = cache->tileToSlot[tile];
+  dword start;
+
+  if (slot != NO_SLOT)
+  {
+    cache->hits++;
+    MarkSlotUsed(cache, slot);
+    return slot << 3;
+  }
+
+  cache->misses++;
+
+  slot = cache->leastRecent;
+
+  if (cache->slotToTile[slot] != NO_TILE)
+  {
+    cache->tileToSlot[cache->slotToTile[slot]] = NO_SLOT;
+  }
+
+  cache->slotToTile[slot] = tile;
+  cache->tileToSlot[tile] = slot;
+  MarkSlotUsed(cache, slot);
+
+  start = ReadHighResClock();
+
+  EGA_SET_DEFAULT_MODE();
+  PROFILE_BEGIN(PROFILE_TILE_UPLOAD);
+  UploadTile(cache->tileset + tile * 32, VMEM_TILES_OFFSET + (slot << 3));
+  PROFILE_END(PROFILE_TILE_UPLOAD);
+  EGA_SETUP_LATCH_COPY();
+
+  cache->uploadTicks += ReadHighResClock() - start;
+
+  return slot << 3;
+}
+
+
+/*******************************************************************************
+
+  Planar back buffer
+
+  An alternative to drawing straight into video memory: Frames are composed
+  in main memory, in the same format as the buffer for DrawFullscreen (4
+  planes of 8000 bytes). Everything drawn marks the tile cells it touches as
+  dirty. Flushing then merges horizontally adjacent dirty cells into spans,
+  and copies only those to video memory, one plane at a time.
+
+*******************************************************************************/
+
+#define BACK_BUFFER_PLANE_SIZE 8000
+
+// At most every other cell in a row can start a new span
+#define MAX_DIRTY_SPANS (MAP_CELLS / 2)
+
+typedef struct
+{
+  byte far* pixels;
+  byte* dirtyCells;
+
+  // Collected once per flush, then copied for each plane
+  word* spanOffsets;
+  word* spanWidths;
+  word numSpans;
+} BackBuffer;
+
+
+static int InitBackBuffer(BackBuffer* backBuffer)
+{
+  memset(backBuffer, 0, sizeof(BackBuffer));
+
+  backBuffer->pixels = farmalloc(4L * BACK_BUFFER_PLANE_SIZE);
+  backBuffer->dirtyCells = malloc(MAP_CELLS);
+  backBuffer->spanOffsets = malloc(MAX_DIRTY_SPANS * sizeof(word));
+  backBuffer->spanWidths = malloc(MAX_DIRTY_SPANS * sizeof(word));
+
+  if (
+    !backBuffer->pixels || !backBuffer->dirtyCells ||
+    !backBuffer->spanOffsets || !backBuffer->spanWidths)
+  {
+    if (backBuffer->pixels)
+    {
+      farfree(backBuffer->pixels);
+    }
+
+    free(backBuffer->dirtyCells);
+    free(backBuffer->spanOffsets);
+    free(backBuffer->spanWidths);
+    return 0;
+  }
+
+  memset(backBuffer->dirtyCells, 0, MAP_CELLS);
+  return 1;
+}
+
+
+static void DestroyBackBuffer(BackBuffer* backBuffer)
+{
+  farfree(backBuffer->pixels);
+  free(backBuffer->dirtyCells);
+  free(backBuffer->spanOffsets);
+  free(backBuffer->spanWidths);
+}
+
+
+// Marks all cells touched by the given rectangle as dirty. x and width are in
+// bytes (8 pixel units), y and height in pixels.
+static void MarkDirtyRect(
+  BackBuffer* backBuffer,
+  int x,
+  int y,
+  int width,
+  int height)
+{
+  int firstRow = y >> 3;
+  int lastRow = (y + height - 1) >> 3;
+  int col;
+  int row;
+
+  for (row = firstRow; row <= lastRow; row++)
+  {
+    for (col = x; col < x + width; col++)
+    {
+      backBuffer->dirtyCells[row * MAP_WIDTH + col] = 1;
+    }
+  }
+}
+
+
+// Draws a tile from a tileset in the format used by DrawSolidTileSlow into the
+// given cell of the back buffer
+static void DrawTileToBackBuffer(
+  BackBuffer* backBuffer,
+  const byte* tile,
+  int col,
+  int row)
+{
+  byte far* dest = backBuffer->pixels + row * 320 + col;
+  int y;
+
+  for (y = 0; y < 8; y++, tile += 4, dest += 40)
+  {
+    dest[0] = tile[0];
+    dest[BACK_BUFFER_PLANE_SIZE] = tile[1];
+    dest[2 * BACK_BUFFER_PLANE_SIZE] = tile[2];
+    dest[3 * BACK_BUFFER_PLANE_SIZE] = tile[3];
+  }
+
+  MarkDirtyRect(backBuffer, col, row * 8, 1, 8);
+}
+
+
+// Draws a masked tile (see DrawMaskedTile) into the back buffer. x is in bytes,
+// y in pixels.
+static void DrawMaskedTileToBackBuffer(
+  BackBuffer* backBuffer,
+  const byte* tile,
+  int x,
+  int y)
+{
+  byte far* dest = backBuffer->pixels + (word)y * 40 + x;
+  int row;
+
+  for (row = 0; row < 8; row++, tile += 5, dest += 40)
+  {
+    byte mask = tile[0];
+
+    dest[0] = (dest[0] & mask) | tile[1];
+    dest[BACK_BUFFER_PLANE_SIZE] =
+      (dest[BACK_BUFFER_PLANE_SIZE] & mask) | tile[2];
+    dest[2 * BACK_BUFFER_PLANE_SIZE] =
+      (dest[2 * BACK_BUFFER_PLANE_SIZE] & mask) | tile[3];
+    dest[3 * BACK_BUFFER_PLANE_SIZE] =
+      (dest[3 * BACK_BUFFER_PLANE_SIZE] & mask) | tile[4];
+  }
+
+  MarkDirtyRect(backBuffer, x, y, 1, 8);
+}
+
+
+// Copies numLines lines of width bytes from one plane of the back buffer to
+// the same location in video memory. The plane must be selected already.
+static void FlushSpan(
+  const byte far* source,
+  word destOffset,
+  word width,
+  word numLines)
+{
+  asm push  ds
+
+  asm mov   ax,VMEM_SEG
+  asm mov   es,ax
+  asm mov   di,[destOffset]
+  asm mov   bx,[width]
+  asm mov   dx,[numLines]
+  asm lds   si,[source]
+
+  // Distance from the end of the span to the start of the next line
+  asm mov   ax,40
+  asm sub   ax,bx
+
+nextLine:
+  asm mov   cx,bx
+  asm shr   cx,1
+  asm rep   movsw
+  asm adc   cx,cx
+  asm rep   movsb
+  asm add   si,ax
+  asm add   di,ax
+  asm dec   dx
+  asm jnz   nextLine
+
+  asm pop   ds
+}
+
+
+// Copies all dirty cells to video memory and marks them clean again. Returns
+// the number of bytes written to video memory.
+static dword FlushBackBuffer(BackBuffer* backBuffer)
+{
+  byte* dirty = backBuffer->dirtyCells;
+  dword bytesWritten = 0;
+  word i;
+  int plane;
+  int start;
+  int col;
+  int row;
+
+  backBuffer->numSpans = 0;
+
+  for (row = 0; row < MAP_HEIGHT; row++, dirty += MAP_WIDTH)
+  {
+    for (col = 0; col < MAP_WIDTH;)
+    {
+      if (!dirty[col])
+      {
+        col++;
+        continue;
+      }
+
+      for (start = col; col < MAP_WIDTH && dirty[col]; col++)
+      {
+        dirty[col] = 0;
+      }
+
+      backBuffer->spanOffsets[backBuffer->numSpans] = row * 320 + start;
+      backBuffer->spanWidths[backBuffer->numSpans] = col - start;
+      backBuffer->numSpans++;
+
+      bytesWritten += (col - start) * 8 * 4;
+    }
+  }
+
+  EGA_SET_DEFAULT_MODE();
+
+  for (plane = 0; plane < 4; plane++)
+  {
+    const byte far* pixels =
+      backBuffer->pixels + plane * BACK_BUFFER_PLANE_SIZE;
+
+    outport(0x03c4, (0x100 << plane) | 0x02);
+
+    PROFILE_BEGIN(PROFILE_FLUSH_SPANS);
+
+    for (i = 0; i < backBuffer->numSpans; i++)
+    {
+      FlushSpan(
+        pixels + backBuffer->spanOffsets[i],
+        backBuffer->spanOffsets[i],
+        backBuffer->spanWidths[i],
+        8);
+    }
+
+    PROFILE_END(PROFILE_FLUSH_SPANS);
+  }
+
+  return bytesWritten;
+}
+
+
+/*******************************************************************************
+
+  VGA Mode Y backend
+
+  Mode Y is the unchained variant of VGA mode 0x13: 320x200 with 256 colors,
+  where each byte in video memory holds a single pixel, and consecutive pixels
+  of a line are spread across the 4 planes. Latch copies work the same way as
+  in EGA mode 0xD, but each byte moves 4 pixels instead of 8, so a line is 80
+  bytes long. 256 KB of video memory are enough for 4 pages. We use two, and
+  keep tiles and a full-screen background image in the remaining space.
+
+*******************************************************************************/
+
+#define MODEY_PITCH     80
+#define MODEY_PAGE_SIZE 0x4000
+
+// Each tile is stored as 16 consecutive bytes in each plane, 2 per row, with
+// plane n holding pixels n and n + 4 of a row
+#define MODEY_TILES_OFFSET 0x8000
+#define MODEY_TILE_BYTES   16
+
+#define MODEY_BACKGROUND_OFFSET 0xc000
+
+// Amount of video memory written for a full screen, across all 4 planes
+#define MODEY_SCREEN_BYTES 64000L
+
+/*
+Same as EGA_SETUP_LATCH_COPY, but keeps the graphics controller's 256-color
+shift mode enabled. Without it, the display turns into garbage.
+*/
+#define MODEY_SETUP_LATCH_COPY() asm { \
+  mov dx, 0x3c4;  \
+  mov ax, 0xf02;  \
+  out dx, ax;     \
+  mov dx, 0x3ce;  \
+  mov ax, 0x4105; \
+  out dx, ax;     \
+}
+
+
+static void InitModeY(void)
+{
+  // Start out with mode 0x13, then disable chain-4 and odd/even addressing
+  // in the sequencer, and switch the CRTC from doubleword to byte mode
+  _AX = 0x13;
+  geninterrupt(0x10);
+
+  outport(0x03c4, 0x0604);
+  outport(0x03d4, 0x0014);
+  outport(0x03d4, 0xe317);
+
+  // Mode 0x13 only clears the memory visible in chained mode, so clear all
+  // 4 pages
+  outport(0x03c4, 0x0f02);
+  _fmemset(VMEM, 0, 0xffff);
+  VMEM[0xffff] = 0;
+
+  SetDuke2Palette();
+}
+
+
+// Returns the color of pixel x (0-7) in one row of a tile, in the format used
+// by DrawSolidTileSlow (4 bytes per row, one per plane)
+static byte TilePixel(const byte* row, int x)
+{
+  byte bit = 0x80 >> x;
+
+  return
+    ((row[0] & bit) ? 1 : 0) |
+    ((row[1] & bit) ? 2 : 0) |
+    ((row[2] & bit) ? 4 : 0) |
+    ((row[3] & bit) ? 8 : 0);
+}
+
+
+// Returns the color of pixel (x, y) in a full-screen image, in the format used
+// by DrawFullscreen (8000 bytes per plane)
+static byte ImagePixel(const byte* image, word x, word y)
+{
+  word offset = y * 40 + (x >> 3);
+  byte bit = 0x80 >> (x & 7);
+
+  return
+    ((image[offset] & bit) ? 1 : 0) |
+    ((image[offset + 8000] & bit) ? 2 : 0) |
+    ((image[offset + 16000] & bit) ? 4 : 0) |
+    ((image[offset + 24000] & bit) ? 8 : 0);
+}
+
+
+// Converts EGA tiles to 256 colors, and stores them at MODEY_TILES_OFFSET
+static void UploadTilesModeY(const byte* tiles, int numTiles)
+{
+  byte far* dest;
+  const byte* src;
+  int plane;
+  int i;
+  int row;
+
+  for (plane = 0; plane < 4; plane++)
+  {
+    outport(0x03c4, (0x100 << plane) | 0x02);
+
+    dest = MK_FP(VMEM_SEG, MODEY_TILES_OFFSET);
+    src = tiles;
+
+    for (i = 0; i < numTiles; i++)
+    {
+      for (row = 0; row < 8; row++, src += 4)
+      {
+        *dest++ = TilePixel(src, plane);
+        *dest++ = TilePixel(src, plane + 4);
+      }
+    }
+  }
+}
+
+
+// Converts a full-screen EGA image to 256 colors, and stores it at the given
+// offset in video memory
+static void UploadImageModeY(const byte* image, word destOffset)
+{
+  byte far* dest;
+  int plane;
+  word x;
+  word y;
+
+  for (plane = 0; plane < 4; plane++)
+  {
+    outport(0x03c4, (0x100 << plane) | 0x02);
+
+    dest = MK_FP(VMEM_SEG, destOffset);
+
+    for (y = 0; y < 200; y++)
+    {
+      for (x = plane; x < 320; x += 4)
+      {
+        *dest++ = ImagePixel(image, x, y);
+      }
+    }
+  }
+}
+
+
+// Mode Y version of DrawSolidTile. A tile row is 2 bytes wide here, which
+// still need to be copied one at a time: The latches only hold the most
+// recently read byte, so a movsw would write the second byte's data twice.
+static void DrawSolidTileModeY(word sourceOffset, word destOffset)
+{
+  asm push  ds
+
+  asm mov   dx,VMEM_SEG
+  asm mov   es,dx
+  asm mov   ds,dx
+  asm mov   si,[sourceOffset]
+  asm mov   di,[destOffset]
+  asm mov   bx, MODEY_PITCH - 2
+
+  asm movsb
+  asm movsb
+  asm add   di,bx
+  asm movsb
+  asm movsb
+  asm add   di,bx
+  asm movsb
+  asm movsb
+  asm add   di,bx
+  asm movsb
+  asm movsb
+  asm add   di,bx
+  asm movsb
+  asm movsb
+  asm add   di,bx
+  asm movsb
+  asm movsb
+  asm add   di,bx
+  asm movsb
+  asm movsb
+  asm add   di,bx
+  asm movsb
+  asm movsb
+
+  asm pop   ds
+}
+
+
+static void DrawTiledFullscreenModeY(word destOffset)
+{
+  int col;
+  word row;
+  word src = MODEY_TILES_OFFSET;
+
+  MODEY_SETUP_LATCH_COPY();
+
+  for (
+    row = destOffset;
+    row < destOffset + 25 * 8 * MODEY_PITCH;
+    row += 8 * MODEY_PITCH)
+  {
+    for (col = 0; col < 80; col += 2)
+    {
+      DrawSolidTileModeY(src, col + row);
+      src += MODEY_TILE_BYTES;
+    }
+  }
+}
+
+
+/*******************************************************************************
+
+  VGA mode 0x13 backend
+
+  Mode 0x13 is VGA's chunky 320x200 mode with 256 colors: Each byte holds one
+  pixel, and the screen is a linear 64000 byte block at VMEM_SEG. There is no
+  latch copy trick to be had here. Instead, frames are composed in a back
+  buffer in main memory at CPU speed, and then copied to video memory in one
+  go, which is limited by the speed of the bus.
+
+*******************************************************************************/
+
+#define CHUNKY_PITCH       320
+#define CHUNKY_SCREEN_SIZE 64000L
+
+// 8 rows of 8 pixels
+#define CHUNKY_TILE_BYTES 64
+
+
+static void InitMode13(void)
+{
+  _AX = 0x13;
+  geninterrupt(0x10);
+
+  SetDuke2Palette();
+}
+
+
+// Converts EGA tiles to one byte per pixel
+static void MakeChunkyTiles(const byte* tiles, byte far* dest, int numTiles)
+{
+  int i;
+  int row;
+  int x;
+
+  for (i = 0; i < numTiles; i++)
+  {
+    for (row = 0; row < 8; row++, tiles += 4)
+    {
+      for (x = 0; x < 8; x++)
+      {
+        *dest++ = TilePixel(tiles, x);
+      }
+    }
+  }
+}
+
+
+// Converts a full-screen EGA image to one byte per pixel
+static void MakeChunkyImage(const byte* image, byte far* dest)
+{
+  word x;
+  word y;
+
+  for (y = 0; y < 200; y++)
+  {
+    for (x = 0; x < 320; x++)
+    {
+      *dest++ = ImagePixel(image, x, y);
+    }
+  }
+}
+
+
+// Copies an 8x8 tile into a back buffer with a pitch of CHUNKY_PITCH
+static void DrawTileChunky(const byte far* tile, byte far* dest)
+{
+  asm push  ds
+
+  asm lds   si,[tile]
+  asm les   di,[dest]
+  asm mov   bx, CHUNKY_PITCH - 8
+  asm mov   dx, 8
+
+nextRow:
+  asm movsw
+  asm movsw
+  asm movsw
+  asm movsw
+  asm add   di,bx
+  asm dec   dx
+  asm jnz   nextRow
+
+  asm pop   ds
+}
+
+
+// Like DrawTileChunky, but treats color 0 as transparent
+static void DrawMaskedTileChunky(const byte far* tile, byte far* dest)
+{
+  asm push  ds
+
+  asm lds   si,[tile]
+  asm les   di,[dest]
+  asm mov   bx, CHUNKY_PITCH - 8
+  asm mov   dx, 8
+
+nextRow:
+  asm mov   cx, 8
+
+nextPixel:
+  asm lodsb
+  asm test  al,al
+  asm jz    skip
+  asm mov   es:[di],al
+
+skip:
+  asm inc   di
+  asm loop  nextPixel
+
+  asm add   di,bx
+  asm dec   dx
+  asm jnz   nextRow
+
+  asm pop   ds
+}
+
+
+// Composes a full screen of tiles in storage order, like DrawTiledFullscreen
+static void DrawTiledFullscreenChunky(
+  const byte far* tiles,
+  byte far* backBuffer)
+{
+  int col;
+  int row;
+
+  for (row = 0; row < 25; row++)
+  {
+    for (col = 0; col < 40; col++)
+    {
+      DrawTileChunky(tiles, backBuffer + col * 8);
+      tiles += CHUNKY_TILE_BYTES;
+    }
+
+    backBuffer += 8 * CHUNKY_PITCH;
+  }
+}
+
+
+// Copies a full-screen back buffer to video memory, either using rep movsw,
+// or rep movsd on a 386 if useDword is set
+static void BlitChunky(const byte far* backBuffer, int useDword)
+{
+  asm push  ds
+
+  asm mov   ax,VMEM_SEG
+  asm mov   es,ax
+  asm xor   di,di
+  asm mov   bx,[useDword]
+  asm lds   si,[backBuffer]
+
+  asm test  bx,bx
+  asm jnz   dwords
+
+  asm mov   cx, 32000
+  asm rep   movsw
+  asm jmp   done
+
+dwords:
+  asm mov   cx, 16000
+  asm db    0x66
+  asm rep   movsw
+
+done:
+  asm pop   ds
+}
+
+
+/*******************************************************************************
+
+  Measurement and statistics
+
+*******************************************************************************/
+
+#define HISTOGRAM_BINS 256
+
+// Per-frame timings are collected into a histogram with a fixed number of
+// bins, so that no memory needs to be allocated while measuring. The bin width
+// is chosen based on the duration of a warm-up frame, such that the histogram
+// covers up to 4 times that duration. Slower frames are counted in the last
+// bin. Min, max, and mean are tracked exactly.
+typedef struct
+{
+  dword binWidth;
+  word bins[HISTOGRAM_BINS];
+  word count;
+  dword min;
+  dword max;
+  dword sum;
+  double sumOfSquares;
+} FrameStats;
+
+
+static int numIterations = DEFAULT_ITERATIONS;
+
+
+static float TicksToMs(dword ticks)
+{
+  return (float)ticks * 1000.0f / (float)PIT_FREQUENCY;
+}
+
+
+static void InitFrameStats(FrameStats* stats, dword warmUpTicks)
+{
+  memset(stats, 0, sizeof(FrameStats));
+
+  stats->binWidth = warmUpTicks * 4 / HISTOGRAM_BINS + 1;
+  stats->min = 0xFFFFFFFFL;
+}
+
+
+static void RecordFrame(FrameStats* stats, dword ticks)
+{
+  dword bin = ticks / stats->binWidth;
+
+  if (bin >= HISTOGRAM_BINS)
+  {
+    bin = HISTOGRAM_BINS - 1;
+  }
+
+  stats->bins[(word)bin]++;
+  stats->count++;
+
+  if (ticks < stats->min)
+  {
+    stats->min = ticks;
+  }
+
+  if (ticks > stats->max)
+  {
+    stats->max = ticks;
+  }
+
+  stats->sum += ticks;
+  stats->sumOfSquares += (double)ticks * (double)ticks;
+}
+
+
+// Returns the upper edge of the bin containing the given percentile, clamped
+// to the exact min/max. The result is thus accurate to within one bin width.
+static dword FramePercentile(const FrameStats* stats, int percent)
+{
+  dword rank = ((dword)stats->count * percent + 99) / 100;
+  dword seen = 0;
+  dword value;
+  int i;
+
+  for (i = 0; i < HISTOGRAM_BINS - 1; ++i)
+  {
+    seen += stats->bins[i];
+
+    if (seen >= rank)
+    {
+      break;
+    }
+  }
+
+  value = (i + 1) * stats->binWidth;
+
+  if (value < stats->min)
+  {
+    value = stats->min;
+  }
+
+  if (value > stats->max || i == HISTOGRAM_BINS - 1)
+  {
+    value = stats->max;
+  }
+
+  return value;
+}
+
+
+static float FrameMeanMs(const FrameStats* stats)
+{
+  return stats->count ? TicksToMs(stats->sum) / stats->count : 0.0f;
+}
+
+
+static float FrameStdDevMs(const FrameStats* stats)
+{
+  double mean;
+  double variance;
+
+  if (stats->count == 0)
+  {
+    return 0.0f;
+  }
+
+  mean = (double)stats->sum / stats->count;
+  variance = stats->sumOfSquares / stats->count - mean * mean;
+
+  return variance > 0.0 ? TicksToMs((dword)sqrt(variance)) : 0.0f;
+}
+
+
+#define NOTE_LENGTH 96
+
+// Summary of a benchmark run, as shown in the final report
+typedef struct
+{
+  word frames;
+  float meanMs;
+  float stdDevMs;
+  float minMs;
+  float p50Ms;
+  float p95Ms;
+  float p99Ms;
+  float maxMs;
+  float bytesPerSecond;
+
+  // Additional, benchmark-specific information
+  char note[NOTE_LENGTH];
+} BenchmarkResult;
+
+
+// Appends text to a note, separated by a comma, and truncated as necessary to
+// fit into NOTE_LENGTH
+static void AppendNote(char* note, const char* text)
+{
+  if (note[0])
+  {
+    strncat(note, ", ", NOTE_LENGTH - 1 - strlen(note));
+  }
+
+  strncat(note, text, NOTE_LENGTH - 1 - strlen(note));
+}
+
+
+static void SummarizeFrameStats(
+  const FrameStats* stats,
+  dword bytesPerFrame,
+  BenchmarkResult* result)
+{
+  result->frames = stats->count;
+  result->meanMs = FrameMeanMs(stats);
+  result->stdDevMs = FrameStdDevMs(stats);
+  result->minMs = TicksToMs(stats->min);
+  result->p50Ms = TicksToMs(FramePercentile(stats, 50));
+  result->p95Ms = TicksToMs(FramePercentile(stats, 95));
+  result->p99Ms = TicksToMs(FramePercentile(stats, 99));
+  result->maxMs = TicksToMs(stats->max);
+  result->bytesPerSecond = result->meanMs > 0.0f
+    ? bytesPerFrame * 1000.0f / result->meanMs
+    : 0.0f;
+}
+
+
+static void PrintResult(const char* name, const BenchmarkResult* result)
+{
+  printf("%s (%u frames):\n", name, result->frames);
+  printf(
+    "  mean %.3f ms, std dev %.3f ms\n",
+    result->meanMs,
+    result->stdDevMs);
+  printf(
+    "  min %.3f, p50 %.3f, p95 %.3f, p99 %.3f, max %.3f ms\n",
+    result->minMs,
+    result->p50Ms,
+    result->p95Ms,
+    result->p99Ms,
+    result->maxMs);
+
+  if (result->note[0])
+  {
+    printf("  %s\n", result->note);
+  }
+}
+
+
+/*******************************************************************************
+
+  Hardware probe
+
+  Detects the CPU class and video adapter, and measures how fast the CPU can
+  access video memory. This is shown in the report and written to the CSV
+  file along with each result, so that results from different machines can
+  be told apart. Bandwidth is measured in mode 0xD with all planes enabled,
+  so it's the number of bytes transferred by the CPU, not the number of bytes
+  changed in video memory. The primitives used for that are also available
+  as microbenchmarks, together with a few others.
+
+*******************************************************************************/
+
+#define PROBE_BYTES   16000
+#define PROBE_REPEATS 8
+
+typedef struct
+{
+  int cpuClass;
+  const char* videoAdapter;
+  word videoMemoryKb;
+
+  float writeBytesPerSecond;      // rep stosb
+  float writeWordsBytesPerSecond; // rep stosw
+  float readBytesPerSecond;       // rep lodsw
+} HardwareInfo;
+
+
+static const char* GetVideoAdapterName(void)
+{
+  if (IsVga())
+  {
+    return "VGA";
+  }
+
+  // Get EGA information. Without an EGA, BL is left unchanged.
+  _BX = 0xff10;
+  _AH = 0x12;
+  geninterrupt(0x10);
+
+  return _BL != 0x10 ? "EGA" : "unknown";
+}
+
+
+// Returns the amount of video memory reported by the EGA/VGA BIOS
+static word GetVideoMemoryKb(void)
+{
+  _BX = 0xff10;
+  _AH = 0x12;
+  geninterrupt(0x10);
+
+  return _BL <= 3 ? 64 << _BL : 0;
+}
+
+
+static void WriteVramBytes(word count)
+{
+  asm mov   ax,VMEM_SEG
+  asm mov   es,ax
+  asm xor   di,di
+  asm xor   ax,ax
+  asm mov   cx,[count]
+  asm rep   stosb
+}
+
+
+static void WriteVramWords(word count)
+{
+  asm mov   ax,VMEM_SEG
+  asm mov   es,ax
+  asm xor   di,di
+  asm xor   ax,ax
+  asm mov   cx,[count]
+  asm shr   cx,1
+  asm rep   stosw
+}
+
+
+static void ReadVramWords(word count)
+{
+  asm push  ds
+
+  asm mov   cx,[count]
+  asm shr   cx,1
+  asm mov   ax,VMEM_SEG
+  asm mov   ds,ax
+  asm xor   si,si
+  asm rep   lodsw
+
+  asm pop   ds
+}
+
+
+// Copies count bytes from main memory to the start of video memory
+static void CopyToVramBytes(const char near* source, word count)
+{
+  asm mov   si,[source]
+  asm mov   ax,VMEM_SEG
+  asm mov   es,ax
+  asm xor   di,di
+  asm mov   cx,[count]
+  asm rep   movsb
+}
+
+
+// Copies count bytes from the start of video memory to main memory
+static void CopyFromVramBytes(char near* dest, word count)
+{
+  asm push  ds
+
+  asm mov   di,[dest]
+  asm mov   cx,[count]
+  asm mov   ax,ds
+  asm mov   es,ax
+  asm mov   ax,VMEM_SEG
+  asm mov   ds,ax
+  asm xor   si,si
+  asm rep   movsb
+
+  asm pop   ds
+}
+
+
+// Issues count OUTs to the sequencer and graphics controller, the same way as
+// EGA_SELECT_PLANE does (which is included in the cost). Enables all planes
+// for writing, and plane 0 for reading. count must be a multiple of 8.
+static void RepeatPlaneSelect(word count)
+{
+  asm mov   cx,[count]
+  asm shr   cx,1
+  asm shr   cx,1
+  asm shr   cx,1
+
+next:
+  EGA_SELECT_PLANE(0xf02, 0x004);
+  EGA_SELECT_PLANE(0xf02, 0x004);
+  EGA_SELECT_PLANE(0xf02, 0x004);
+  EGA_SELECT_PLANE(0xf02, 0x004);
+  asm loop  next
+}
+
+
+// Returns the bandwidth achieved by the given access function, in bytes per
+// second
+static float MeasureVramBandwidth(void (*access)(word))
+{
+  dword start;
+  dword ticks;
+  int i;
+
+  start = ReadHighResClock();
+
+  for (i = 0; i < PROBE_REPEATS; i++)
+  {
+    access(PROBE_BYTES);
+  }
+
+  ticks = ReadHighResClock() - start;
+
+  return ticks ?
+    (float)PROBE_BYTES * PROBE_REPEATS * PIT_FREQUENCY / ticks : 0.0f;
+}
+
+
+// Must be called after InitVideo() and InstallTimer(). Overwrites the first
+// PROBE_BYTES of video memory.
+static void ProbeHardware(HardwareInfo* info)
+{
+  info->cpuClass = GetCpuClass();
+  info->videoAdapter = GetVideoAdapterName();
+  info->videoMemoryKb = GetVideoMemoryKb();
+
+  EGA_SET_DEFAULT_MODE();
+  outport(0x03c4, (0x0f << 8) | 0x02);
+
+  info->writeBytesPerSecond = MeasureVramBandwidth(WriteVramBytes);
+  info->writeWordsBytesPerSecond = MeasureVramBandwidth(WriteVramWords);
+  info->readBytesPerSecond = MeasureVramBandwidth(ReadVramWords);
+}
+
+
+static void PrintHardwareInfo(const HardwareInfo* info)
+{
+  printf(
+    "CPU: %d%s, video: %s with %u KB\n",
+    info->cpuClass,
+    info->cpuClass == 486 ? " or newer" : "",
+    info->videoAdapter,
+    info->videoMemoryKb);
+  printf(
+    "Video memory: write %.0f KB/s (byte), %.0f KB/s (word), "
+    "read %.0f KB/s (word)\n",
+    info->writeBytesPerSecond / 1024.0f,
+    info->writeWordsBytesPerSecond / 1024.0f,
+    info->readBytesPerSecond / 1024.0f);
+}
+
+
+/*******************************************************************************
+
+  Video memory allocator
+
+  Hands out regions of off-screen video memory in mode 0xD, as offsets
+  relative to VMEM_SEG (i.e. per plane). It's a simple bump allocator: The
+  display pages and the tile storage are reserved once at startup, at the
+  locations the drawing code expects. Benchmarks allocate whatever else they
+  need during setup, and the runner releases it after teardown by going back
+  to a mark taken before setup.
+
+  Mode Y benchmarks use their own layout (see MODEY_PAGE_SIZE), since the
+  memory is addressed differently there.
+
+*******************************************************************************/
+
+// The drawing code addresses the tile storage via VMEM_TILES_SEG, and the
+// tile cache uses it for its slots
+#define TILE_STORAGE_SIZE 0x2000
+
+static dword vramTop;
+static dword vramLimit;
+
+
+static void InitVramAllocator(word videoMemoryKb)
+{
+  vramTop = 0;
+  vramLimit = 0x10000L;
+
+  // Each plane gets a quarter of the memory
+  if (videoMemoryKb && videoMemoryKb * 256L < vramLimit)
+  {
+    vramLimit = videoMemoryKb * 256L;
+  }
+}
+
+
+// Allocates size bytes, starting at a multiple of alignment. Returns 0 if
+// there's not enough video memory left.
+static int AllocVram(word size, word alignment, word* offset)
+{
+  dword start = (vramTop + alignment - 1) / alignment * alignment;
+
+  if (start + size > vramLimit)
+  {
+    return 0;
+  }
+
+  *offset = (word)start;
+  vramTop = start + size;
+  return 1;
+}
+
+
+static dword MarkVram(void)
+{
+  return vramTop;
+}
+
+
+// Frees everything allocated since the given mark was taken
+static void ReleaseVram(dword mark)
+{
+  vramTop = mark;
+}
+
+
+static dword FreeVram(void)
+{
+  return vramLimit - vramTop;
+}
+
+
+// Reserves the 2 display pages used via SetDisplayPage(), followed by the
+// tile storage. Returns 0 if there's not enough video memory.
+static int ReserveFixedVram(void)
+{
+  word pages;
+  word tiles;
+
+  return
+    AllocVram(2 * PAGE_SIZE, PAGE_SIZE, &pages) &&
+    AllocVram(TILE_STORAGE_SIZE, 16, &tiles) &&
+    tiles == VMEM_TILES_OFFSET;
+}
+
+
+/*******************************************************************************
+
+  Benchmarks
+
+  Each benchmark is described by an entry in the BENCHMARKS table below. The
+  setup function loads data and prepares video memory, and returns 0 if the
+  benchmark can't be run. drawFrame is then invoked repeatedly while being
+  timed, drawing into page 0 while page 1 is displayed. Teardown is optional.
+
+*******************************************************************************/
+
+#define PREVIEW_MS 500
+
+#define SCREEN_BYTES 32000L
+
+typedef struct
+{
+  const char* name;
+  const char* description;
+  int (*setup)(void);
+  void (*drawFrame)(void);
+  void (*teardown)(void);
+
+  // Slow benchmarks can divide the number of iterations by this factor
+  int iterationDivisor;
+
+  // Amount of pixel data written to video memory per frame, used for
+  // reporting throughput
+  dword bytesPerFrame;
+
+  // Benchmark-specific parameter, available to the setup function via
+  // benchmarkParam
+  int param;
+
+  int flags;
+} Benchmark;
+
+// drawFrame flips between pages on its own, the runner must not change the
+// displayed page while timing
+#define BENCHMARK_FLIPS_PAGES 1
+
+// drawFrame draws into the page at drawPageOffset, so the benchmark can be run
+// with vsync presentation
+#define BENCHMARK_PAGED 2
+
+// drawFrame reads the high-resolution clock or accesses files, so it can't be
+// timed with interrupts disabled
+#define BENCHMARK_NEEDS_INTERRUPTS 4
+
+// The amount of work per frame depends on numSprites, so the benchmark can be
+// run with a frame budget, see FindMaxSprites()
+#define BENCHMARK_SCALES_SPRITES 8
+
+
+static char near* buffer;
+static int benchmarkParam;
+
+// Initialized from the benchmark's bytesPerFrame, setup can adjust it if the
+// amount depends on command-line options, teardown if it's only known after
+// running
+static dword frameBytes;
+
+// Number of operations per frame, for benchmarks measuring the cost of a
+// single operation. The report then shows the time per operation, and the
+// throughput if bytesPerFrame is set as well.
+static dword frameOps;
+
+static int numSprites = DEFAULT_SPRITES;
+
+// Offset of the page that paged benchmarks should draw into. Always 0 unless
+// running with vsync presentation.
+static word drawPageOffset;
+
+// Set via -v: Present each frame by flipping pages in sync with the vertical
+// retrace, instead of measuring raw drawing time
+static int vsyncMode;
+
+// Set via -t: Like vsync presentation, but rotating through 3 pages, see
+// TimeTripleBufferedFrames(). Implies vsyncMode.
+static int tripleBuffering;
+
+// Set via -f: Instead of drawing numSprites sprites, find the maximum number
+// of sprites that can be drawn within this many milliseconds per frame
+static float frameBudgetMs;
+
+// Set via -i: Time each frame with interrupts disabled, in addition to the
+// regular measurement, see TimeWithoutInterrupts()
+static int interruptFreeMode;
+
+// Setup and teardown can put additional information here, to be shown in the
+// report
+static char benchmarkNote[NOTE_LENGTH];
+
+// Setup can measure a reference implementation via MeasureMeanTicks(), the
+// report then shows the speedup compared to it
+static dword baselineTicks;
+static const char* baselineName;
+
+
+static int LoadFile(const char* filename, char near* dest, word size)
+{
+  FILE* fp = fopen(filename, "rb");
+
+  if (!fp)
+  {
+    return 0;
+  }
+
+  fread(dest, size, 1, fp);
+  fclose(fp);
+
+  return 1;
+}
+
+
+// Loads a tileset into the latch-copy tile storage in small chunks, so that
+// rendering can continue in between. Tile data is read into the given buffer,
+// which must be large enough to hold a chunk.
+typedef struct
+{
+  FILE* fp;
+  char near* chunkBuffer;
+  word chunkSize;
+  word size;
+  word offset;
+} TileStreamer;
+
+
+static int OpenTileStream(
+  TileStreamer* streamer,
+  const char* filename,
+  char near* chunkBuffer,
+  word chunkSize)
+{
+  streamer->fp = fopen(filename, "rb");
+
+  if (!streamer->fp)
+  {
+    return 0;
+  }
+
+  fseek(streamer->fp, 0, SEEK_END);
+  streamer->size = (word)ftell(streamer->fp);
+  fseek(streamer->fp, 0, SEEK_SET);
+
+  streamer->chunkBuffer = chunkBuffer;
+  streamer->chunkSize = chunkSize;
+  streamer->offset = 0;
+  return 1;
+}
+
+
+// Starts loading the tileset again from the beginning
+static void RestartTileStream(TileStreamer* streamer)
+{
+  fseek(streamer->fp, 0, SEEK_SET);
+  streamer->offset = 0;
+}
+
+
+// Loads and uploads the next chunk, returns non-zero once the entire tileset
+// has been loaded
+static int StreamNextChunk(TileStreamer* streamer)
+{
+  word size = streamer->chunkSize;
+
+  if (streamer->offset >= streamer->size)
+  {
+    return 1;
+  }
+
+  if (size > streamer->size - streamer->offset)
+  {
+    size = streamer->size - streamer->offset;
+  }
+
+  fread(streamer->chunkBuffer, size, 1, streamer->fp);
+
+  // 4 bytes of source data per byte of video memory (one for each plane)
+  CopyTilesToVram(
+    (byte*)streamer->chunkBuffer,
+    size / 4,
+    VMEM_TILES_OFFSET + streamer->offset / 4);
+
+  streamer->offset += size;
+  return streamer->offset >= streamer->size;
+}
+
+
+static void CloseTileStream(TileStreamer* streamer)
+{
+  fclose(streamer->fp);
+}
+
+
+// Returns the mean duration of a frame drawn with the given function, in
+// PIT ticks, drawing into page 0.
+static dword MeasureMeanTicks(void (*drawFrame)(void), int frames)
+{
+  dword start;
+  int i;
+
+  drawFrame();
+
+  start = ReadHighResClock();
+
+  for (i = 0; i < frames; i++)
+  {
+    drawFrame();
+  }
+
+  return (ReadHighResClock() - start) / frames;
+}
+
+
+static int SetupFullscreen(void)
+{
+  return LoadFile("BONUSSCN.MNI", buffer, 32000);
+}
+
+
+static void DrawFullscreenFrame(void)
+{
+  DrawFullscreen(buffer, drawPageOffset);
+}
+
+
+static word backgroundOffset;
+
+
+// Allocates off-screen video memory for the full-screen image in buffer, and
+// copies it there
+static int SetupBackground(void)
+{
+  if (!AllocVram(8000, 16, &backgroundOffset))
+  {
+    return 0;
+  }
+
+  CopyImageToVram((byte*)buffer, backgroundOffset);
+  return 1;
+}
+
+
+// Latch full-screen: Copy a full-screen image that's been prepared in
+// off-screen video memory to page 0, via a single latch copy. This should be
+// the fastest possible way to update the entire screen.
+static int SetupLatchFullscreen(void)
+{
+  if (!SetupFullscreen() || !SetupBackground())
+  {
+    return 0;
+  }
+
+  baselineTicks = MeasureMeanTicks(DrawFullscreenFrame, 32);
+  baselineName = "plain";
+  return 1;
+}
+
+
+static void DrawLatchFullscreenFrame(void)
+{
+  EGA_SETUP_LATCH_COPY();
+  LatchCopy(backgroundOffset, drawPageOffset, 8000);
+}
+
+
+static int SetupTiles(void)
+{
+  if (!LoadFile("DROP12.MNI", buffer, 32000))
+  {
+    return 0;
+  }
+
+  // Copy the data to vram so that we can draw it via latch copy
+  CopyTilesToVram(buffer, 8000, VMEM_TILES_OFFSET);
+  return 1;
+}
+
+
+static void DrawTiledFullscreenFrame(void)
+{
+  DrawTiledFullscreen(drawPageOffset);
+}
+
+
+static int SetupTilesSlow(void)
+{
+  return LoadFile("DROP12.MNI", buffer, 32000);
+}
+
+
+static void DrawTiledFullscreenSlowFrame(void)
+{
+  DrawTiledFullscreenSlow(buffer, drawPageOffset);
+}
+
+
+// Wide tiles: Like the slow tiled benchmark, but drawing blocks of 2 or 4
+// tiles at once using word or dword moves. benchmarkParam is the number of
+// tiles per block.
+static int SetupWideTiles(void)
+{
+  if (benchmarkParam == 4 && !Is386())
+  {
+    return 0;
+  }
+
+  if (!LoadFile("DROP12.MNI", buffer, 32000))
+  {
+    return 0;
+  }
+
+  MakeWideTiles((byte*)buffer, MAP_CELLS, benchmarkParam);
+  return 1;
+}
+
+
+static void DrawWideTilesFrame(void)
+{
+  if (benchmarkParam == 4)
+  {
+    DrawTiledFullscreenSlow32(buffer);
+  }
+  else
+  {
+    DrawTiledFullscreenSlow16(buffer);
+  }
+}
+
+
+// Metatiles: Drawing the screen using 16x16 or 32x32 pixel metatiles
+// (benchmarkParam is the size), either via latch copy or from main memory.
+// Compared to the tiled benchmarks, there are 4 or 16 times fewer calls, with
+// the same amount of data per frame. Each metatile is made up of the tiles
+// that appear in its place in the tiled benchmarks, so the screen looks the
+// same. Only rows which fit on the screen entirely are drawn, i.e. 192 of the
+// 200 lines. The time of the baseline is scaled accordingly.
+#define METATILE_LINES 192
+
+// Relative to VMEM_TILES_SEG, as expected by the metatile kernels
+static word metatilesOffset;
+
+static byte far* slowMetatiles;
+
+
+static int NumMetatiles(void)
+{
+  return (40 / (benchmarkParam / 8)) * (METATILE_LINES / benchmarkParam);
+}
+
+
+// Returns the data for one row of one plane of a metatile, as a pointer into
+// the tileset in buffer
+static byte* MetatileSource(int metatile, int row, int col)
+{
+  int tilesPerSide = benchmarkParam / 8;
+  int metatilesPerRow = 40 / tilesPerSide;
+  int tileRow = (metatile / metatilesPerRow) * tilesPerSide + row / 8;
+  int tileCol = (metatile % metatilesPerRow) * tilesPerSide + col;
+
+  return (byte*)buffer + (tileRow * 40 + tileCol) * 32 + (row % 8) * 4;
+}
+
+
+static int SetupMetatiles(void)
+{
+  int widthBytes = benchmarkParam / 8;
+  word dest;
+  int i;
+  int row;
+  int col;
+
+  if (
+    !SetupTiles() ||
+    !AllocVram(NumMetatiles() * widthBytes * benchmarkParam, 16, &dest))
+  {
+    return 0;
+  }
+
+  metatilesOffset = dest - VMEM_TILES_OFFSET;
+
+  baselineTicks =
+    MeasureMeanTicks(DrawTiledFullscreenFrame, 32) * METATILE_LINES / 200;
+  baselineName = "tiled";
+
+  for (i = 0; i < NumMetatiles(); i++)
+  {
+    for (row = 0; row < benchmarkParam; row++)
+    {
+      for (col = 0; col < widthBytes; col++)
+      {
+        CopyTilesToVram(MetatileSource(i, row, col), 1, dest++);
+      }
+    }
+  }
+
+  sprintf(benchmarkNote, "%d calls per frame", NumMetatiles());
+  return 1;
+}
+
+
+static void DrawMetatilesFrame(void)
+{
+  word src = metatilesOffset;
+  word row;
+  int col;
+
+  EGA_SETUP_LATCH_COPY();
+
+  if (benchmarkParam == 32)
+  {
+    for (row = 0; row < METATILE_LINES * 40; row += 32 * 40)
+    {
+      for (col = 0; col < 40; col += 4)
+      {
+        DrawSolidMetatile32(src, col + row);
+        src += 4 * 32;
+      }
+    }
+  }
+  else
+  {
+    for (row = 0; row < METATILE_LINES * 40; row += 16 * 40)
+    {
+      for (col = 0; col < 40; col += 2)
+      {
+        DrawSolidMetatile16(src, col + row);
+        src += 2 * 16;
+      }
+    }
+  }
+}
+
+
+static int SetupSlowMetatiles(void)
+{
+  int widthBytes = benchmarkParam / 8;
+  byte far* dest;
+  int i;
+  int row;
+  int plane;
+  int col;
+
+  if (!SetupTilesSlow())
+  {
+    return 0;
+  }
+
+  baselineTicks =
+    MeasureMeanTicks(DrawTiledFullscreenSlowFrame, 8) * METATILE_LINES / 200;
+  baselineName = "slow";
+
+  slowMetatiles =
+    farmalloc((long)NumMetatiles() * benchmarkParam * 4 * widthBytes);
+
+  if (!slowMetatiles)
+  {
+    return 0;
+  }
+
+  dest = slowMetatiles;
+
+  for (i = 0; i < NumMetatiles(); i++)
+  {
+    for (row = 0; row < benchmarkParam; row++)
+    {
+      for (plane = 0; plane < 4; plane++)
+      {
+        for (col = 0; col < widthBytes; col++)
+        {
+          *dest++ = MetatileSource(i, row, col)[plane];
+        }
+      }
+    }
+  }
+
+  sprintf(benchmarkNote, "%d calls per frame", NumMetatiles());
+  return 1;
+}
+
+
+static void DrawSlowMetatilesFrame(void)
+{
+  const byte far* src = slowMetatiles;
+  word row;
+  int col;
+
+  EGA_SET_DEFAULT_MODE();
+
+  if (benchmarkParam == 32)
+  {
+    for (row = 0; row < METATILE_LINES * 40; row += 32 * 40)
+    {
+      for (col = 0; col < 40; col += 4)
+      {
+        DrawSolidMetatileSlow32(src, col + row);
+        src += 4 * 4 * 32;
+      }
+    }
+  }
+  else
+  {
+    for (row = 0; row < METATILE_LINES * 40; row += 16 * 40)
+    {
+      for (col = 0; col < 40; col += 2)
+      {
+        DrawSolidMetatileSlow16(src, col + row);
+        src += 2 * 4 * 16;
+      }
+    }
+  }
+}
+
+
+static void TeardownSlowMetatiles(void)
+{
+  farfree(slowMetatiles);
+}
+
+
+// Batched: Like the slow tiled benchmark, but with the tile data in
+// plane-major order, so that the plane only needs to be selected 4 times per
+// frame (benchmarkParam == 0) or 4 times per tile row (benchmarkParam == 1),
+// instead of 4 times per tile.
+static int SetupBatchedTiles(void)
+{
+  return
+    LoadFile("DROP12.MNI", buffer, 32000) &&
+    MakePlaneMajorTiles((byte*)buffer, MAP_CELLS);
+}
+
+
+static void DrawBatchedTilesFrame(void)
+{
+  if (benchmarkParam)
+  {
+    DrawTiledFullscreenBatchedRows(buffer);
+  }
+  else
+  {
+    DrawTiledFullscreenBatched(buffer);
+  }
+}
+
+
+// Tile cache: Draw a tile map using tiles from a tileset of CACHE_TILES tiles,
+// via a tile cache with CACHE_SLOTS slots. The map scrolls by a row of tiles
+// per frame, with each new row using random tiles out of a working set of
+// benchmarkParam tiles.
+#define CACHE_TILES 2000
+#define CACHE_SLOTS 512
+
+static TileCache tileCache;
+static byte far* cacheTileset;
+static int cacheTopRow;
+static dword cacheFrames;
+
+
+static void ScrollCacheMap(void)
+{
+  word* row = tileMap + cacheTopRow * MAP_WIDTH;
+  int col;
+
+  for (col = 0; col < MAP_WIDTH; col++)
+  {
+    row[col] = Random() % benchmarkParam;
+  }
+
+  cacheTopRow = (cacheTopRow + 1) % MAP_HEIGHT;
+}
+
+
+static int SetupTileCache(void)
+{
+  word i;
+
+  if (!LoadFile("DROP12.MNI", buffer, 32000))
+  {
+    return 0;
+  }
+
+  cacheTileset = farmalloc(CACHE_TILES * 32L);
+
+  if (!cacheTileset)
+  {
+    return 0;
+  }
+
+  // Make a tileset twice as large as the one we have, by inverting the
+  // original for the second half
+  for (i = 0; i < MAP_CELLS; i++)
+  {
+    MakePlanarTile((byte*)buffer + i * 32, cacheTileset + i * 32);
+  }
+
+  for (i = 0; i < 32000; i++)
+  {
+    cacheTileset[32000 + i] = ~cacheTileset[i];
+  }
+
+  if (!InitTileCache(&tileCache, cacheTileset, CACHE_TILES, CACHE_SLOTS))
+  {
+    farfree(cacheTileset);
+    return 0;
+  }
+
+  SeedRandom(1);
+
+  for (i = 0; i < MAP_HEIGHT; i++)
+  {
+    ScrollCacheMap();
+  }
+
+  cacheFrames = 0;
+  return 1;
+}
+
+
+static void DrawTileCacheFrame(void)
+{
+  int col;
+  int row;
+  int mapRow = cacheTopRow;
+
+  EGA_SETUP_LATCH_COPY();
+
+  for (row = 0; row < 25 * 320; row += 320)
+  {
+    word* cells = tileMap + mapRow * MAP_WIDTH;
+
+    for (col = 0; col < 40; col++)
+    {
+      DrawSolidTile(GetCachedTile(&tileCache, cells[col]), col + row);
+    }
+
+    mapRow = (mapRow + 1) % MAP_HEIGHT;
+  }
+
+  ScrollCacheMap();
+  cacheFrames++;
+}
+
+
+static void TeardownTileCache(void)
+{
+  dword lookups = tileCache.hits + tileCache.misses;
+
+  if (lookups && cacheFrames)
+  {
+    sprintf(
+      benchmarkNote,
+      "hit rate %.1f%%, %.1f uploads/frame, %.3f ms upload/frame",
+      tileCache.hits * 100.0f / lookups,
+      (float)tileCache.misses / cacheFrames,
+      TicksToMs(tileCache.uploadTicks) / cacheFrames);
+  }
+
+  DestroyTileCache(&tileCache);
+  farfree(cacheTileset);
+}
+
+
+// Upload: Upload the full tileset to video memory each frame, either via
+// CopyTilesToVram (benchmarkParam == 0), or from plane-major data using
+// UploadPlanarToVram.
+static int SetupUpload(void)
+{
+  if (!LoadFile("DROP12.MNI", buffer, 32000))
+  {
+    return 0;
+  }
+
+  return benchmarkParam ? MakePlaneMajorTiles((byte*)buffer, MAP_CELLS) : 1;
+}
+
+
+static void DrawUploadFrame(void)
+{
+  EGA_SET_DEFAULT_MODE();
+
+  if (benchmarkParam)
+  {
+    UploadPlanarToVram((byte*)buffer, 8000, VMEM_TILES_OFFSET);
+  }
+  else
+  {
+    CopyTilesToVram((byte*)buffer, 8000, VMEM_TILES_OFFSET);
+  }
+}
+
+
+// Streaming: Draw a screen full of tiles via latch copy, while loading the
+// tileset in chunks of one row of tiles per frame. Once the tileset has been
+// loaded completely, loading starts over. The first load isn't timed, since
+// it also spans the runner's preview and warm-up frames.
+#define STREAM_CHUNK_SIZE (40 * 32)
+
+static TileStreamer tileStreamer;
+static int streamTiming;
+static dword streamStartTicks;
+static dword streamTotalTicks;
+static int streamLoads;
+static dword oneShotLoadTicks;
+
+
+static int SetupStreaming(void)
+{
+  dword start = ReadHighResClock();
+
+  // For comparison, time loading and uploading the tileset in one go
+  if (!SetupTiles())
+  {
+    return 0;
+  }
+
+  oneShotLoadTicks = ReadHighResClock() - start;
+
+  if (!OpenTileStream(
+    &tileStreamer, "DROP12.MNI", buffer, STREAM_CHUNK_SIZE))
+  {
+    return 0;
+  }
+
+  streamTiming = 0;
+  streamTotalTicks = 0;
+  streamLoads = 0;
+  return 1;
+}
+
+
+static void DrawStreamingFrame(void)
+{
+  if (StreamNextChunk(&tileStreamer))
+  {
+    dword now = ReadHighResClock();
+
+    if (streamTiming)
+    {
+      streamTotalTicks += now - streamStartTicks;
+      streamLoads++;
+    }
+
+    streamTiming = 1;
+    streamStartTicks = now;
+    RestartTileStream(&tileStreamer);
+  }
+
+  DrawTiledFullscreen(0);
+}
+
+
+static void TeardownStreaming(void)
+{
+  CloseTileStream(&tileStreamer);
+
+  if (streamLoads)
+  {
+    sprintf(
+      benchmarkNote,
+      "load latency %.1f ms streamed, %.1f ms one-shot",
+      TicksToMs(streamTotalTicks) / streamLoads,
+      TicksToMs(oneShotLoadTicks));
+  }
+}
+
+
+// Compiled tiles: Draw a tile map made up of the first COMPILED_TILES tiles,
+// using either compiled tiles (benchmarkParam == COMPILED_CODE), or for
+// comparison, DrawSolidTileSlow or latch copies.
+#define COMPILED_TILES 64
+
+#define COMPILED_CODE  0
+#define COMPILED_SLOW  1
+#define COMPILED_LATCH 2
+
+static byte far* compiledCode;
+static word* compiledTileOffsets;
+
+
+static int SetupCompiledTiles(void)
+{
+  word size = 0;
+  int i;
+
+  if (!SetupTiles())
+  {
+    return 0;
+  }
+
+  SeedRandom(1);
+
+  for (i = 0; i < MAP_CELLS; i++)
+  {
+    tileMap[i] = Random() % COMPILED_TILES;
+  }
+
+  if (benchmarkParam != COMPILED_CODE)
+  {
+    return 1;
+  }
+
+  compiledCode = farmalloc((dword)COMPILED_TILES * COMPILED_TILE_MAX_BYTES);
+  compiledTileOffsets = malloc(COMPILED_TILES * sizeof(word));
+
+  if (!compiledCode || !compiledTileOffsets)
+  {
+    farfree(compiledCode);
+    free(compiledTileOffsets);
+    return 0;
+  }
+
+  for (i = 0; i < COMPILED_TILES; i++)
+  {
+    compiledTileOffsets[i] = FP_OFF(compiledCode) + size;
+    size += CompileTile((byte*)buffer + i * 32, compiledCode + size);
+  }
+
+  sprintf(
+    benchmarkNote,
+    "%d tiles compiled, %u bytes of code (%u per tile)",
+    COMPILED_TILES,
+    size,
+    size / COMPILED_TILES);
+  return 1;
+}
+
+
+static void DrawCompiledTilesFrame(void)
+{
+  switch (benchmarkParam)
+  {
+    case COMPILED_CODE:
+      DrawCompiledTileMap(compiledCode, compiledTileOffsets);
+      break;
+
+    case COMPILED_SLOW:
+      DrawTileMapSlow(buffer);
+      break;
+
+    case COMPILED_LATCH:
+      DrawTileMap(0);
+      break;
+  }
+}
+
+
+static void TeardownCompiledTiles(void)
+{
+  if (benchmarkParam == COMPILED_CODE)
+  {
+    farfree(compiledCode);
+    free(compiledTileOffsets);
+  }
+}
+
+
+// Dirty tiles: Only redraw the cells of the tile map that changed since the
+// respective page was last drawn. benchmarkParam is the percentage of cells
+// changed per frame.
+static word* drawnTiles[2];
+static int backPage;
+static int tilesChangedPerFrame;
+static dword dirtyTilesDrawn;
+static dword dirtyFrames;
+
+
+static int SetupDirtyTiles(void)
+{
+  if (!SetupTiles())
+  {
+    return 0;
+  }
+
+  drawnTiles[0] = malloc(MAP_CELLS * sizeof(word));
+  drawnTiles[1] = malloc(MAP_CELLS * sizeof(word));
+
+  if (!drawnTiles[0] || !drawnTiles[1])
+  {
+    free(drawnTiles[0]);
+    free(drawnTiles[1]);
+    return 0;
+  }
+
+  InvalidateDrawnTiles(drawnTiles[0]);
+  InvalidateDrawnTiles(drawnTiles[1]);
+
+  InitLinearTileMap();
+  SeedRandom(1);
+
+  tilesChangedPerFrame = (int)((long)MAP_CELLS * benchmarkParam / 100);
+  backPage = 0;
+  dirtyTilesDrawn = 0;
+  dirtyFrames = 0;
+  return 1;
+}
+
+
+static void DrawDirtyTilesFrame(void)
+{
+  word count;
+
+  ChangeRandomTiles(tilesChangedPerFrame);
+  count = DrawDirtyTiles(drawnTiles[backPage], backPage * PAGE_SIZE);
+
+  // The first frame for each page draws it completely, so skip those
+  if (++dirtyFrames > 2)
+  {
+    dirtyTilesDrawn += count;
+  }
+
+  // Not via SetDisplayPage: The BIOS might enable interrupts, which would
+  // break timing with -i
+  SetStartAddress(backPage * PAGE_SIZE);
+  backPage = !backPage;
+}
+
+
+// Each page is drawn every other frame, so the cells redrawn are those that
+// changed in either of the last 2 frames, i.e. up to twice the percentage
+// changed per frame. The throughput is based on the cells actually drawn.
+static void TeardownDirtyTiles(void)
+{
+  free(drawnTiles[0]);
+  free(drawnTiles[1]);
+
+  if (dirtyFrames > 2)
+  {
+    frameBytes = dirtyTilesDrawn * 32 / (dirtyFrames - 2);
+
+    sprintf(
+      benchmarkNote,
+      "%.1f%% of cells redrawn",
+      100.0f * dirtyTilesDrawn / ((dirtyFrames - 2) * (float)MAP_CELLS));
+  }
+}
+
+
+// Tile map: Draw a map via latch copies, with benchmarkParam selecting
+// how the map is generated. The map file, if used, is MAP_FILENAME.
+#define MAP_LINEAR    0
+#define MAP_REPEATING 1
+#define MAP_RANDOM    2
+#define MAP_FROM_FILE 3
+
+#define MAP_FILENAME "TILEMAP.BIN"
+
+
+static int SetupTileMap(void)
+{
+  if (!SetupTiles())
+  {
+    return 0;
+  }
+
+  SeedRandom(1);
+
+  switch (benchmarkParam)
+  {
+    case MAP_LINEAR:
+      InitLinearTileMap();
+      break;
+
+    case MAP_REPEATING:
+      InitRepeatingTileMap();
+      break;
+
+    case MAP_RANDOM:
+      InitRandomTileMap();
+      break;
+
+    case MAP_FROM_FILE:
+      return LoadTileMap(MAP_FILENAME);
+  }
+
+  return 1;
+}
+
+
+static void DrawTileMapFrame(void)
+{
+  DrawTileMap(drawPageOffset);
+}
+
+
+// Tile spans: Draw a map via DrawTileSpans, with benchmarkParam being the
+// maximum run length for InitRunLengthTileMap, or 0 to use MAP_FILENAME. The
+// same map drawn one tile at a time via DrawTileMap serves as a baseline.
+static int SetupTileSpans(void)
+{
+  word sheetOffset;
+
+  if (!SetupTiles() || !AllocVram(TILE_SHEET_SIZE, 16, &sheetOffset))
+  {
+    return 0;
+  }
+
+  SeedRandom(1);
+
+  if (benchmarkParam)
+  {
+    InitRunLengthTileMap(benchmarkParam);
+  }
+  else if (!LoadTileMap(MAP_FILENAME))
+  {
+    return 0;
+  }
+
+  tileSpans = farmalloc(MAP_CELLS * sizeof(TileSpan));
+
+  if (!tileSpans)
+  {
+    return 0;
+  }
+
+  MakeTileSheet(sheetOffset);
+  BuildTileSpans(sheetOffset);
+
+  sprintf(
+    benchmarkNote,
+    "%d spans, %.1f tiles per span",
+    numTileSpans,
+    (float)MAP_CELLS / numTileSpans);
+
+  baselineTicks = MeasureMeanTicks(DrawTileMapFrame, 32);
+  baselineName = "call per tile";
+  return 1;
+}
+
+
+static void DrawTileSpansFrame(void)
+{
+  DrawTileSpans(drawPageOffset);
+}
+
+
+static void TeardownTileSpans(void)
+{
+  farfree(tileSpans);
+}
+
+
+// Latch rows: Draw the linear tile map using DrawTileRowsLatch, either once
+// per row of tiles (benchmarkParam == 1) or once for the entire screen.
+static int SetupLatchRows(void)
+{
+  if (!SetupTiles())
+  {
+    return 0;
+  }
+
+  InitLinearTileMap();
+
+  baselineTicks = MeasureMeanTicks(DrawTileMapFrame, 32);
+  baselineName = "call per tile";
+  return 1;
+}
+
+
+static void DrawLatchRowsFrame(void)
+{
+  int row;
+
+  EGA_SETUP_LATCH_COPY();
+
+  if (benchmarkParam)
+  {
+    for (row = 0; row < 25; row++)
+    {
+      DrawTileRowsLatch(tileMap + row * 40, drawPageOffset + row * 320, 1);
+    }
+  }
+  else
+  {
+    DrawTileRowsLatch(tileMap, drawPageOffset, 25);
+  }
+}
+
+
+// Scrolling: Scroll the tile map by one pixel per frame using the CRTC
+// start address and pel panning, back and forth between the start and
+// SCROLL_RANGE pixels. benchmarkParam selects the direction, and whether only
+// the newly exposed edge is drawn when crossing a tile boundary, or the
+// entire screen.
+#define SCROLL_HORIZONTAL      0
+#define SCROLL_HORIZONTAL_FULL 1
+#define SCROLL_VERTICAL        2
+
+// Limited by the 16 kB available for the virtual screen in pages 0 and 1
+#define SCROLL_RANGE_X 1600
+#define SCROLL_RANGE_Y 160
+
+static int scrollPos;
+static int scrollStep;
+
+
+static int SetupScroll(void)
+{
+  word row;
+
+  if (!SetupTiles())
+  {
+    return 0;
+  }
+
+  InitLinearTileMap();
+
+  SetLineOffset(SCROLL_PITCH / 2);
+  SetStartAddress(0);
+  SetPelPanning(0);
+
+  EGA_SETUP_LATCH_COPY();
+
+  for (row = 0; row < MAP_HEIGHT + 1; row++)
+  {
+    DrawScrollRow(0, row);
+  }
+
+  scrollPos = 0;
+  scrollStep = 1;
+  return 1;
+}
+
+
+static void DrawScrollFrame(void)
+{
+  int oldTile = scrollPos >> 3;
+  int newTile;
+  int range =
+    benchmarkParam == SCROLL_VERTICAL ? SCROLL_RANGE_Y : SCROLL_RANGE_X;
+
+  scrollPos += scrollStep;
+
+  if (scrollPos == 0 || scrollPos == range)
+  {
+    scrollStep = -scrollStep;
+  }
+
+  newTile = scrollPos >> 3;
+
+  if (newTile != oldTile)
+  {
+    int edge;
+
+    EGA_SETUP_LATCH_COPY();
+
+    switch (benchmarkParam)
+    {
+      case SCROLL_HORIZONTAL:
+        edge = newTile > oldTile ? newTile + MAP_WIDTH : newTile;
+        DrawScrollColumn(edge, 0);
+        break;
+
+      case SCROLL_HORIZONTAL_FULL:
+        for (edge = 0; edge < MAP_HEIGHT; edge++)
+        {
+          DrawScrollRow(newTile, edge);
+        }
+        break;
+
+      case SCROLL_VERTICAL:
+        edge = newTile > oldTile ? newTile + MAP_HEIGHT : newTile;
+        DrawScrollRow(0, edge);
+        break;
+    }
+  }
+
+  if (benchmarkParam == SCROLL_VERTICAL)
+  {
+    SetStartAddress(scrollPos * SCROLL_PITCH);
+  }
+  else
+  {
+    SetStartAddress(scrollPos >> 3);
+    SetPelPanning(scrollPos & 7);
+  }
+}
+
+
+static void TeardownScroll(void)
+{
+  SetLineOffset(20);
+  SetStartAddress(0);
+  SetPelPanning(0);
+}
+
+
+// Sprites: Draw numSprites sprites made up of masked tiles, moving around
+// the screen. benchmarkParam selects whether the background is redrawn first,
+// either via latch copy or from main memory. Otherwise, the sprites are drawn
+// on top of the previous frame.
+#define SPRITES_NO_BACKGROUND    0
+#define SPRITES_LATCH_BACKGROUND 1
+#define SPRITES_SLOW_BACKGROUND  2
+
+#define SPRITE_WIDTH  4  // in tiles
+#define SPRITE_HEIGHT 4
+#define SPRITE_TILES  (SPRITE_WIDTH * SPRITE_HEIGHT)
+
+#define MAX_SPRITES 256
+
+typedef struct
+{
+  int x;  // in bytes, i.e. 8 pixel units
+  int y;  // in pixels
+  int dx;
+  int dy;
+} Sprite;
+
+static byte* maskedTiles;
+static Sprite* sprites;
+
+
+// Creates masked tiles from the first tiles of the tileset in buffer, treating
+// color 0 as transparent
+static void MakeMaskedTiles(byte* dest, int count)
+{
+  byte* src = (byte*)buffer;
+  int i;
+  int row;
+
+  for (i = 0; i < count; i++)
+  {
+    for (row = 0; row < 8; row++)
+    {
+      dest[0] = ~(src[0] | src[1] | src[2] | src[3]);
+      dest[1] = src[0];
+      dest[2] = src[1];
+      dest[3] = src[2];
+      dest[4] = src[3];
+
+      dest += 5;
+      src += 4;
+    }
+  }
+}
+
+
+static void DrawSprite(const Sprite* sprite)
+{
+  byte* tile = maskedTiles;
+  word rowOffset = drawPageOffset + sprite->y * 40 + sprite->x;
+  int col;
+  int row;
+
+  for (row = 0; row < SPRITE_HEIGHT; row++)
+  {
+    for (col = 0; col < SPRITE_WIDTH; col++)
+    {
+      DrawMaskedTile(tile, rowOffset + col);
+      tile += MASKED_TILE_BYTES;
+    }
+
+    rowOffset += 8 * 40;
+  }
+}
+
+
+static void MoveSprite(Sprite* sprite)
+{
+  sprite->x += sprite->dx;
+  sprite->y += sprite->dy;
+
+  if (sprite->x <= 0 || sprite->x >= 40 - SPRITE_WIDTH)
+  {
+    sprite->dx = -sprite->dx;
+  }
+
+  if (sprite->y <= 0 || sprite->y >= 200 - SPRITE_HEIGHT * 8)
+  {
+    sprite->dy = -sprite->dy;
+  }
+}
+
+
+static void InitSprites(void)
+{
+  int i;
+
+  for (i = 0; i < MAX_SPRITES; i++)
+  {
+    sprites[i].x = 1 + Random() % (40 - SPRITE_WIDTH - 1);
+    // Keep y even, so that moving by 2 lines per frame reaches the edges
+    sprites[i].y = 2 * (1 + Random() % ((200 - SPRITE_HEIGHT * 8) / 2 - 1));
+    sprites[i].dx = Random() & 1 ? 1 : -1;
+    sprites[i].dy = Random() & 1 ? 2 : -2;
+  }
+}
+
+
+static void DrawSprites(int count)
+{
+  int i;
+
+  EGA_SET_DEFAULT_MODE();
+
+  for (i = 0; i < count; i++)
+  {
+    MoveSprite(&sprites[i]);
+    DrawSprite(&sprites[i]);
+  }
+}
+
+
+static int SetupSprites(void)
+{
+  if (!SetupTiles())
+  {
+    return 0;
+  }
+
+  maskedTiles = malloc(SPRITE_TILES * MASKED_TILE_BYTES);
+  sprites = malloc(MAX_SPRITES * sizeof(Sprite));
+
+  if (!maskedTiles || !sprites)
+  {
+    free(maskedTiles);
+    free(sprites);
+    return 0;
+  }
+
+  MakeMaskedTiles(maskedTiles, SPRITE_TILES);
+
+  SeedRandom(1);
+  InitSprites();
+
+  frameBytes += (dword)numSprites * SPRITE_TILES * 32;
+  return 1;
+}
+
+
+static void DrawSpritesFrame(void)
+{
+  // SetupTiles leaves the tileset in buffer, as needed for drawing from main
+  // memory
+  if (benchmarkParam == SPRITES_LATCH_BACKGROUND)
+  {
+    DrawTiledFullscreen(drawPageOffset);
+  }
+  else if (benchmarkParam == SPRITES_SLOW_BACKGROUND)
+  {
+    DrawTiledFullscreenSlow(buffer, drawPageOffset);
+  }
+
+  DrawSprites(numSprites);
+}
+
+
+static void TeardownSprites(void)
+{
+  free(maskedTiles);
+  free(sprites);
+}
+
+
+// Parallax: A composite frame like in Cosmo or Duke II. A backdrop image is
+// latch-copied from off-screen video memory, scrolling by one byte every other
+// frame. On top of that, a layer of masked tiles with empty cells in between
+// scrolls by one tile per frame, followed by numSprites sprites. Each layer
+// is timed separately, and the report shows the mean time per frame for each.
+#define PARALLAX_TILES 64
+#define NO_PARALLAX_TILE 0xff
+
+static byte* parallaxMap;
+static int parallaxFrame;
+static dword backdropTicks;
+static dword foregroundTicks;
+static dword parallaxSpriteTicks;
+
+
+static int SetupParallax(void)
+{
+  int i;
+
+  if (!SetupFullscreen() || !SetupBackground() || !SetupTilesSlow())
+  {
+    return 0;
+  }
+
+  // The sprites use the first masked tiles
+  maskedTiles = malloc(PARALLAX_TILES * MASKED_TILE_BYTES);
+  sprites = malloc(MAX_SPRITES * sizeof(Sprite));
+  parallaxMap = malloc(MAP_CELLS);
+
+  if (!maskedTiles || !sprites || !parallaxMap)
+  {
+    free(maskedTiles);
+    free(sprites);
+    free(parallaxMap);
+    return 0;
+  }
+
+  MakeMaskedTiles(maskedTiles, PARALLAX_TILES);
+
+  // Fill about a quarter of the cells
+  SeedRandom(1);
+
+  for (i = 0; i < MAP_CELLS; i++)
+  {
+    parallaxMap[i] =
+      Random() % 4 == 0 ? Random() % PARALLAX_TILES : NO_PARALLAX_TILE;
+  }
+
+  InitSprites();
+
+  parallaxFrame = 0;
+  backdropTicks = 0;
+  foregroundTicks = 0;
+  parallaxSpriteTicks = 0;
+
+  frameBytes += (dword)numSprites * SPRITE_TILES * 32;
+  return 1;
+}
+
+
+static void DrawParallaxForeground(void)
+{
+  int scroll = parallaxFrame % MAP_WIDTH;
+  word rowOffset = drawPageOffset;
+  byte* mapRow = parallaxMap;
+  byte tile;
+  int col;
+  int row;
+
+  EGA_SET_DEFAULT_MODE();
+
+  for (row = 0; row < MAP_HEIGHT; row++)
+  {
+    for (col = 0; col < MAP_WIDTH; col++)
+    {
+      tile = mapRow[(col + scroll) % MAP_WIDTH];
+
+      if (tile != NO_PARALLAX_TILE)
+      {
+        DrawMaskedTile(
+          maskedTiles + tile * MASKED_TILE_BYTES, rowOffset + col);
+      }
+    }
+
+    mapRow += MAP_WIDTH;
+    rowOffset += 8 * 40;
+  }
+}
+
+
+static void DrawParallaxFrame(void)
+{
+  dword start = ReadHighResClock();
+  dword now;
+
+  EGA_SETUP_LATCH_COPY();
+  DrawWrappedBackdrop(
+    backgroundOffset, drawPageOffset, (parallaxFrame / 2) % 40);
+
+  now = ReadHighResClock();
+  backdropTicks += now - start;
+  start = now;
+
+  DrawParallaxForeground();
+
+  now = ReadHighResClock();
+  foregroundTicks += now - start;
+  start = now;
+
+  DrawSprites(numSprites);
+
+  parallaxSpriteTicks += ReadHighResClock() - start;
+  parallaxFrame++;
+}
+
+
+static void TeardownParallax(void)
+{
+  free(maskedTiles);
+  free(sprites);
+  free(parallaxMap);
+
+  // With vsync presentation, the note already holds the frame rate etc., so
+  // the layer times are appended, as far as they fit
+  if (parallaxFrame)
+  {
+    char layers[64];
+
+    sprintf(
+      layers,
+      "%sbackdrop %.3f, tiles %.3f, sprites %.3f ms",
+      benchmarkNote[0] ? ", " : "",
+      TicksToMs(backdropTicks) / parallaxFrame,
+      TicksToMs(foregroundTicks) / parallaxFrame,
+      TicksToMs(parallaxSpriteTicks) / parallaxFrame);
+
+    strncat(
+      benchmarkNote, layers, NOTE_LENGTH - 1 - strlen(benchmarkNote));
+  }
+}
+
+
+// Mode Y: VGA 256-color versions of the tiled (fast) and latch full-screen
+// benchmarks, depending on benchmarkParam. The BIOS doesn't know about Mode Y
+// pages, so drawFrame flips pages itself. The speed is compared to the
+// corresponding EGA benchmark, measured before switching modes.
+#define MODEY_TILED      0
+#define MODEY_LATCH_FULL 1
+
+static int modeYBackPage;
+
+
+static int SetupModeY(void)
+{
+  if (!IsVga())
+  {
+    return 0;
+  }
+
+  if (benchmarkParam == MODEY_LATCH_FULL)
+  {
+    if (!SetupFullscreen() || !SetupBackground())
+    {
+      return 0;
+    }
+
+    baselineTicks = MeasureMeanTicks(DrawLatchFullscreenFrame, 32);
+    baselineName = "latchfull";
+
+    InitModeY();
+    UploadImageModeY((byte*)buffer, MODEY_BACKGROUND_OFFSET);
+  }
+  else
+  {
+    if (!SetupTiles())
+    {
+      return 0;
+    }
+
+    baselineTicks = MeasureMeanTicks(DrawTiledFullscreenFrame, 32);
+    baselineName = "tiled";
+
+    InitModeY();
+    UploadTilesModeY((byte*)buffer, 1000);
+  }
+
+  modeYBackPage = 0;
+  return 1;
+}
+
+
+static void DrawModeYFrame(void)
+{
+  word pageOffset = modeYBackPage * MODEY_PAGE_SIZE;
+
+  if (benchmarkParam == MODEY_LATCH_FULL)
+  {
+    MODEY_SETUP_LATCH_COPY();
+    LatchCopy(MODEY_BACKGROUND_OFFSET, pageOffset, 16000);
+  }
+  else
+  {
+    DrawTiledFullscreenModeY(pageOffset);
+  }
+
+  SetStartAddress(pageOffset);
+  modeYBackPage ^= 1;
+}
+
+
+static void TeardownModeY(void)
+{
+  InitVideo();
+  SetDuke2Palette();
+}
+
+
+// Mode 0x13: Composing each frame in a back buffer in main memory, and
+// copying it to video memory. benchmarkParam is a combination of the CHUNKY_
+// flags below. Without CHUNKY_TILES, the back buffer holds a full-screen image
+// which is only copied, like in the plain benchmark. The speed is compared to
+// the corresponding EGA benchmark, except when drawing sprites.
+#define CHUNKY_TILES   1
+#define CHUNKY_SPRITES 2
+#define CHUNKY_DWORD   4
+
+static byte far* chunkyBackBuffer;
+static byte far* chunkyTiles;
+
+
+static int SetupChunky(void)
+{
+  if (!IsVga() || ((benchmarkParam & CHUNKY_DWORD) && !Is386()))
+  {
+    return 0;
+  }
+
+  if (benchmarkParam & CHUNKY_TILES)
+  {
+    if (!SetupTiles())
+    {
+      return 0;
+    }
+
+    if (!(benchmarkParam & CHUNKY_SPRITES))
+    {
+      baselineTicks = MeasureMeanTicks(DrawTiledFullscreenFrame, 32);
+      baselineName = "tiled";
+    }
+  }
+  else
+  {
+    if (!SetupFullscreen())
+    {
+      return 0;
+    }
+
+    baselineTicks = MeasureMeanTicks(DrawFullscreenFrame, 32);
+    baselineName = "plain";
+  }
+
+  chunkyBackBuffer = farmalloc(CHUNKY_SCREEN_SIZE);
+  chunkyTiles = NULL;
+
+  if (!chunkyBackBuffer)
+  {
+    return 0;
+  }
+
+  if (benchmarkParam & CHUNKY_TILES)
+  {
+    chunkyTiles = farmalloc(1000L * CHUNKY_TILE_BYTES);
+
+    if (!chunkyTiles)
+    {
+      farfree(chunkyBackBuffer);
+      return 0;
+    }
+
+    MakeChunkyTiles((byte*)buffer, chunkyTiles, 1000);
+  }
+  else
+  {
+    MakeChunkyImage((byte*)buffer, chunkyBackBuffer);
+  }
+
+  if (benchmarkParam & CHUNKY_SPRITES)
+  {
+    sprites = malloc(MAX_SPRITES * sizeof(Sprite));
+
+    if (!sprites)
+    {
+      if (chunkyTiles)
+      {
+        farfree(chunkyTiles);
+      }
+
+      farfree(chunkyBackBuffer);
+      return 0;
+    }
+
+    SeedRandom(1);
+    InitSprites();
+  }
+
+  InitMode13();
+  return 1;
+}
+
+
+// Sprites use the first tiles of the tileset, like in the sprites benchmark
+static void DrawSpriteChunky(const Sprite* sprite)
+{
+  const byte far* tile = chunkyTiles;
+  byte far* rowStart =
+    chunkyBackBuffer + (word)sprite->y * CHUNKY_PITCH + sprite->x * 8;
+  int col;
+  int row;
+
+  for (row = 0; row < SPRITE_HEIGHT; row++)
+  {
+    for (col = 0; col < SPRITE_WIDTH; col++)
+    {
+      DrawMaskedTileChunky(tile, rowStart + col * 8);
+      tile += CHUNKY_TILE_BYTES;
+    }
+
+    rowStart += 8 * CHUNKY_PITCH;
+  }
+}
+
+
+static void DrawChunkyFrame(void)
+{
+  int i;
+
+  if (benchmarkParam & CHUNKY_TILES)
+  {
+    DrawTiledFullscreenChunky(chunkyTiles, chunkyBackBuffer);
+  }
+
+  if (benchmarkParam & CHUNKY_SPRITES)
+  {
+    for (i = 0; i < numSprites; i++)
+    {
+      MoveSprite(&sprites[i]);
+      DrawSpriteChunky(&sprites[i]);
+    }
+  }
+
+  BlitChunky(chunkyBackBuffer, benchmarkParam & CHUNKY_DWORD);
+}
+
+
+static void TeardownChunky(void)
+{
+  farfree(chunkyBackBuffer);
+
+  if (chunkyTiles)
+  {
+    farfree(chunkyTiles);
+  }
+
+  if (benchmarkParam & CHUNKY_SPRITES)
+  {
+    free(sprites);
+  }
+
+  InitVideo();
+  SetDuke2Palette();
+}
+
+
+// Back buffer: Drawing the linear tile map into a planar back buffer in main
+// memory, and flushing only the dirty parts to page 0 each frame. With a
+// benchmarkParam of 0, numSprites sprites (see above) move across the static
+// map, restoring the tiles underneath first. Otherwise, it's the percentage
+// of cells which are changed every frame, like in the dirty tiles benchmarks.
+// The report shows the actual part of the screen flushed, which is smaller
+// when changed cells happen to coincide, and the throughput is based on that.
+static BackBuffer backBuffer;
+static dword backBufferFlushed;
+static dword backBufferFrames;
+
+
+static void DrawBackBufferCell(word cell)
+{
+  DrawTileToBackBuffer(
+    &backBuffer,
+    (byte*)buffer + tileMap[cell] * 32,
+    cell % MAP_WIDTH,
+    cell / MAP_WIDTH);
+}
+
+
+// Redraws the tiles underneath a sprite
+static void RestoreBackBufferCells(const Sprite* sprite)
+{
+  int firstRow = sprite->y >> 3;
+  int lastRow = (sprite->y + SPRITE_HEIGHT * 8 - 1) >> 3;
+  int col;
+  int row;
+
+  for (row = firstRow; row <= lastRow; row++)
+  {
+    for (col = sprite->x; col < sprite->x + SPRITE_WIDTH; col++)
+    {
+      DrawBackBufferCell(row * MAP_WIDTH + col);
+    }
+  }
+}
+
+
+static void DrawSpriteToBackBuffer(const Sprite* sprite)
+{
+  byte* tile = maskedTiles;
+  int col;
+  int row;
+
+  for (row = 0; row < SPRITE_HEIGHT; row++)
+  {
+    for (col = 0; col < SPRITE_WIDTH; col++)
+    {
+      DrawMaskedTileToBackBuffer(
+        &backBuffer, tile, sprite->x + col, sprite->y + row * 8);
+      tile += MASKED_TILE_BYTES;
+    }
+  }
+}
+
+
+static int SetupBackBuffer(void)
+{
+  word cell;
+
+  // Measure the plain benchmark, which writes the whole screen from main
+  // memory every frame
+  if (!SetupFullscreen())
+  {
+    return 0;
+  }
+
+  baselineTicks = MeasureMeanTicks(DrawFullscreenFrame, 32);
+  baselineName = "plain";
+
+  if (!SetupTilesSlow() || !InitBackBuffer(&backBuffer))
+  {
+    return 0;
+  }
+
+  if (benchmarkParam == 0)
+  {
+    maskedTiles = malloc(SPRITE_TILES * MASKED_TILE_BYTES);
+    sprites = malloc(MAX_SPRITES * sizeof(Sprite));
+
+    if (!maskedTiles || !sprites)
+    {
+      free(maskedTiles);
+      free(sprites);
+      DestroyBackBuffer(&backBuffer);
+      return 0;
+    }
+
+    MakeMaskedTiles(maskedTiles, SPRITE_TILES);
+  }
+
+  SeedRandom(1);
+  InitLinearTileMap();
+
+  if (benchmarkParam == 0)
+  {
+    InitSprites();
+  }
+
+  // Start out with an up-to-date screen
+  for (cell = 0; cell < MAP_CELLS; cell++)
+  {
+    DrawBackBufferCell(cell);
+  }
+
+  FlushBackBuffer(&backBuffer);
+
+  backBufferFlushed = 0;
+  backBufferFrames = 0;
+  return 1;
+}
+
+
+static void DrawBackBufferFrame(void)
+{
+  int count = benchmarkParam * (MAP_CELLS / 100);
+  int i;
+
+  if (benchmarkParam == 0)
+  {
+    for (i = 0; i < numSprites; i++)
+    {
+      RestoreBackBufferCells(&sprites[i]);
+      MoveSprite(&sprites[i]);
+    }
+
+    for (i = 0; i < numSprites; i++)
+    {
+      DrawSpriteToBackBuffer(&sprites[i]);
+    }
+  }
+
+  for (i = 0; i < count; i++)
+  {
+    word cell = Random() % MAP_CELLS;
+
+    tileMap[cell] = Random() % MAP_CELLS;
+    DrawBackBufferCell(cell);
+  }
+
+  backBufferFlushed += FlushBackBuffer(&backBuffer);
+  backBufferFrames++;
+}
+
+
+static void TeardownBackBuffer(void)
+{
+  DestroyBackBuffer(&backBuffer);
+
+  if (benchmarkParam == 0)
+  {
+    free(maskedTiles);
+    free(sprites);
+  }
+
+  if (backBufferFrames)
+  {
+    frameBytes = backBufferFlushed / backBufferFrames;
+
+    sprintf(
+      benchmarkNote,
+      "%.1f%% of screen flushed",
+      100.0f * frameBytes / SCREEN_BYTES);
+  }
+}
+
+
+// Microbenchmarks: The primitive operations that the drawing methods are built
+// from, to allow estimating the cost of each kernel. Writes go to page 0, the
+// latch copy uses the tile storage as source. The content doesn't matter.
+#define MICRO_BYTES 8000
+#define MICRO_OUTS  1000
+
+
+static int SetupMicroBytes(void)
+{
+  EGA_SET_DEFAULT_MODE();
+  outport(0x03c4, (0x0f << 8) | 0x02);
+
+  frameOps = frameBytes;
+  return 1;
+}
+
+
+static int SetupMicroOuts(void)
+{
+  frameOps = MICRO_OUTS;
+  return 1;
+}
+
+
+static void DrawMicroStosbFrame(void)
+{
+  WriteVramBytes(MICRO_BYTES);
+}
+
+
+static void DrawMicroStoswFrame(void)
+{
+  WriteVramWords(MICRO_BYTES);
+}
+
+
+static void DrawMicroMovsbFrame(void)
+{
+  CopyToVramBytes(buffer, MICRO_BYTES);
+}
+
+
+static void DrawMicroReadFrame(void)
+{
+  CopyFromVramBytes(buffer, MICRO_BYTES);
+}
+
+
+static void DrawMicroLatchFrame(void)
+{
+  EGA_SETUP_LATCH_COPY();
+  LatchCopy(VMEM_TILES_OFFSET, 0, MICRO_BYTES);
+}
+
+
+static void DrawMicroOutFrame(void)
+{
+  RepeatPlaneSelect(MICRO_OUTS);
+}
+
+
+static const Benchmark BENCHMARKS[] = {
+  {
+    "plain", "Plain",
+    SetupFullscreen, DrawFullscreenFrame, NULL, 1, SCREEN_BYTES, 0,
+    BENCHMARK_PAGED
+  },
+  {
+    "latchfull", "Plain, via latch copy from off-screen",
+    SetupLatchFullscreen, DrawLatchFullscreenFrame, NULL,
+    1, SCREEN_BYTES, 0, BENCHMARK_PAGED
+  },
+  {
+    "tiled", "Tiled (fast)",
+    SetupTiles, DrawTiledFullscreenFrame, NULL, 1, SCREEN_BYTES, 0,
+    BENCHMARK_PAGED
+  },
+  {
+    // This benchmark is very slow, so only run half the iterations
+    "slow", "Tiled (slow)",
+    SetupTilesSlow, DrawTiledFullscreenSlowFrame, NULL, 2, SCREEN_BYTES, 0,
+    BENCHMARK_PAGED
+  },
+  {
+    "slow16", "Tiled (slow, 16px wide, movsw)",
+    SetupWideTiles, DrawWideTilesFrame, NULL, 2, SCREEN_BYTES, 2, 0
+  },
+  {
+    "slow32", "Tiled (slow, 32px wide, movsd, 386+)",
+    SetupWideTiles, DrawWideTilesFrame, NULL, 2, SCREEN_BYTES, 4, 0
+  },
+  {
+    "meta16", "Tiled (fast, 16x16 metatiles)",
+    SetupMetatiles, DrawMetatilesFrame, NULL,
+    1, METATILE_LINES * 40L * 4, 16, 0
+  },
+  {
+    "meta32", "Tiled (fast, 32x32 metatiles)",
+    SetupMetatiles, DrawMetatilesFrame, NULL,
+    1, METATILE_LINES * 40L * 4, 32, 0
+  },
+  {
+    "metaslow16", "Tiled (slow, 16x16 metatiles)",
+    SetupSlowMetatiles, DrawSlowMetatilesFrame, TeardownSlowMetatiles,
+    2, METATILE_LINES * 40L * 4, 16, 0
+  },
+  {
+    "metaslow32", "Tiled (slow, 32x32 metatiles)",
+    SetupSlowMetatiles, DrawSlowMetatilesFrame, TeardownSlowMetatiles,
+    2, METATILE_LINES * 40L * 4, 32, 0
+  },
+  {
+    "batched", "Tiled (slow, plane-major, 4 plane selects)",
+    SetupBatchedTiles, DrawBatchedTilesFrame, NULL, 1, SCREEN_BYTES, 0, 0
+  },
+  {
+    "batchrow", "Tiled (slow, plane-major, 100 plane selects)",
+    SetupBatchedTiles, DrawBatchedTilesFrame, NULL, 1, SCREEN_BYTES, 1, 0
+  },
+  {
+    "compiled", "Compiled tiles",
+    SetupCompiledTiles, DrawCompiledTilesFrame, TeardownCompiledTiles,
+    1, SCREEN_BYTES, COMPILED_CODE, 0
+  },
+  {
+    "compslow", "Compiled tiles map, drawn slow",
+    SetupCompiledTiles, DrawCompiledTilesFrame, TeardownCompiledTiles,
+    2, SCREEN_BYTES, COMPILED_SLOW, 0
+  },
+  {
+    "complatch", "Compiled tiles map, drawn via latch copy",
+    SetupCompiledTiles, DrawCompiledTilesFrame, TeardownCompiledTiles,
+    1, SCREEN_BYTES, COMPILED_LATCH, 0
+  },
+  {
+    "cache256", "Tile cache (256 tile working set)",
+    SetupTileCache, DrawTileCacheFrame, TeardownTileCache,
+    1, SCREEN_BYTES, 256, BENCHMARK_NEEDS_INTERRUPTS
+  },
+  {
+    "cache512", "Tile cache (512 tile working set)",
+    SetupTileCache, DrawTileCacheFrame, TeardownTileCache,
+    1, SCREEN_BYTES, 512, BENCHMARK_NEEDS_INTERRUPTS
+  },
+  {
+    "cache1k", "Tile cache (1000 tile working set)",
+    SetupTileCache, DrawTileCacheFrame, TeardownTileCache,
+    1, SCREEN_BYTES, 1000, BENCHMARK_NEEDS_INTERRUPTS
+  },
+  {
+    "cache2k", "Tile cache (2000 tile working set)",
+    SetupTileCache, DrawTileCacheFrame, TeardownTileCache,
+    1, SCREEN_BYTES, 2000, BENCHMARK_NEEDS_INTERRUPTS
+  },
+  {
+    "stream", "Tiled (fast), while streaming the tileset",
+    SetupStreaming, DrawStreamingFrame, TeardownStreaming,
+    1, SCREEN_BYTES + STREAM_CHUNK_SIZE, 0, BENCHMARK_NEEDS_INTERRUPTS
+  },
+  {
+    "upload", "Tileset upload (OUT per byte)",
+    SetupUpload, DrawUploadFrame, NULL, 1, SCREEN_BYTES, 0, 0
+  },
+  {
+    "uploadfast", "Tileset upload (plane-major, rep movsw)",
+    SetupUpload, DrawUploadFrame, NULL, 1, SCREEN_BYTES, 1, 0
+  },
+  {
+    "latchrow", "Tile map (linear), asm routine per tile row",
+    SetupLatchRows, DrawLatchRowsFrame, NULL, 1, SCREEN_BYTES, 1,
+    BENCHMARK_PAGED
+  },
+  {
+    "latchscr", "Tile map (linear), asm routine per screen",
+    SetupLatchRows, DrawLatchRowsFrame, NULL, 1, SCREEN_BYTES, 0,
+    BENCHMARK_PAGED
+  },
+  {
+    "dirty0", "Dirty tiles (0% changed)",
+    SetupDirtyTiles, DrawDirtyTilesFrame, TeardownDirtyTiles,
+    1, 0, 0, BENCHMARK_FLIPS_PAGES
+  },
+  {
+    "dirty5", "Dirty tiles (5% changed)",
+    SetupDirtyTiles, DrawDirtyTilesFrame, TeardownDirtyTiles,
+    1, SCREEN_BYTES * 5 / 100, 5, BENCHMARK_FLIPS_PAGES
+  },
+  {
+    "dirty25", "Dirty tiles (25% changed)",
+    SetupDirtyTiles, DrawDirtyTilesFrame, TeardownDirtyTiles,
+    1, SCREEN_BYTES * 25 / 100, 25, BENCHMARK_FLIPS_PAGES
+  },
+  {
+    "dirty100", "Dirty tiles (100% changed)",
+    SetupDirtyTiles, DrawDirtyTilesFrame, TeardownDirtyTiles,
+    1, SCREEN_BYTES, 100, BENCHMARK_FLIPS_PAGES
+  },
+  {
+    "maplinear", "Tile map (linear)",
+    SetupTileMap, DrawTileMapFrame, NULL,
+    1, SCREEN_BYTES, MAP_LINEAR, BENCHMARK_PAGED
+  },
+  {
+    "maprepeat", "Tile map (repeating)",
+    SetupTileMap, DrawTileMapFrame, NULL,
+    1, SCREEN_BYTES, MAP_REPEATING, BENCHMARK_PAGED
+  },
+  {
+    "maprandom", "Tile map (random)",
+    SetupTileMap, DrawTileMapFrame, NULL,
+    1, SCREEN_BYTES, MAP_RANDOM, BENCHMARK_PAGED
+  },
+  {
+    "mapfile", "Tile map (" MAP_FILENAME ")",
+    SetupTileMap, DrawTileMapFrame, NULL,
+    1, SCREEN_BYTES, MAP_FROM_FILE, BENCHMARK_PAGED
+  },
+  {
+    "spans1", "Tile spans (run length 1)",
+    SetupTileSpans, DrawTileSpansFrame, TeardownTileSpans,
+    1, SCREEN_BYTES, 1, BENCHMARK_PAGED
+  },
+  {
+    "spans4", "Tile spans (run length 1-4)",
+    SetupTileSpans, DrawTileSpansFrame, TeardownTileSpans,
+    1, SCREEN_BYTES, 4, BENCHMARK_PAGED
+  },
+  {
+    "spans16", "Tile spans (run length 1-16)",
+    SetupTileSpans, DrawTileSpansFrame, TeardownTileSpans,
+    1, SCREEN_BYTES, 16, BENCHMARK_PAGED
+  },
+  {
+    "spans40", "Tile spans (run length 1-40)",
+    SetupTileSpans, DrawTileSpansFrame, TeardownTileSpans,
+    1, SCREEN_BYTES, 40, BENCHMARK_PAGED
+  },
+  {
+    "spanfile", "Tile spans (" MAP_FILENAME ")",
+    SetupTileSpans, DrawTileSpansFrame, TeardownTileSpans,
+    1, SCREEN_BYTES, 0, BENCHMARK_PAGED
+  },
+  {
+    // A tile boundary is crossed every 8 frames, so the pixel data written is
+    // averaged over that
+    "scrollh", "Scrolling horizontally (edge)",
+    SetupScroll, DrawScrollFrame, TeardownScroll,
+    1, (MAP_HEIGHT + 1) * 32L / 8, SCROLL_HORIZONTAL, BENCHMARK_FLIPS_PAGES
+  },
+  {
+    "scrollhf", "Scrolling horizontally (full)",
+    SetupScroll, DrawScrollFrame, TeardownScroll,
+    1, (MAP_WIDTH + 1) * MAP_HEIGHT * 32L / 8, SCROLL_HORIZONTAL_FULL,
+    BENCHMARK_FLIPS_PAGES
+  },
+  {
+    "scrollv", "Scrolling vertically (edge)",
+    SetupScroll, DrawScrollFrame, TeardownScroll,
+    1, (MAP_WIDTH + 1) * 32L / 8, SCROLL_VERTICAL, BENCHMARK_FLIPS_PAGES
+  },
+  {
+    "sprites", "Sprites over tiles",
+    SetupSprites, DrawSpritesFrame, TeardownSprites,
+    1, SCREEN_BYTES, SPRITES_LATCH_BACKGROUND,
+    BENCHMARK_PAGED | BENCHMARK_SCALES_SPRITES
+  },
+  {
+    "sprslow", "Sprites over tiles (tiles from main memory)",
+    SetupSprites, DrawSpritesFrame, TeardownSprites,
+    1, SCREEN_BYTES, SPRITES_SLOW_BACKGROUND,
+    BENCHMARK_PAGED | BENCHMARK_SCALES_SPRITES
+  },
+  {
+    "spronly", "Sprites only",
+    SetupSprites, DrawSpritesFrame, TeardownSprites,
+    1, 0, SPRITES_NO_BACKGROUND, BENCHMARK_PAGED | BENCHMARK_SCALES_SPRITES
+  },
+  {
+    "parallax", "Parallax: backdrop, masked tiles, and sprites",
+    SetupParallax, DrawParallaxFrame, TeardownParallax,
+    1, SCREEN_BYTES + SCREEN_BYTES / 4, 0,
+    BENCHMARK_PAGED | BENCHMARK_NEEDS_INTERRUPTS | BENCHMARK_SCALES_SPRITES
+  },
+  {
+    "ytiled", "Mode Y (VGA): Tiled (fast)",
+    SetupModeY, DrawModeYFrame, TeardownModeY,
+    1, MODEY_SCREEN_BYTES, MODEY_TILED, BENCHMARK_FLIPS_PAGES
+  },
+  {
+    "ylatch", "Mode Y (VGA): Plain, via latch copy from off-screen",
+    SetupModeY, DrawModeYFrame, TeardownModeY,
+    1, MODEY_SCREEN_BYTES, MODEY_LATCH_FULL, BENCHMARK_FLIPS_PAGES
+  },
+  {
+    // Mode 0x13 only has a single page, so these draw to the visible screen
+    "c13plain", "Mode 0x13 (VGA): Plain, back buffer copy (movsw)",
+    SetupChunky, DrawChunkyFrame, TeardownChunky,
+    1, CHUNKY_SCREEN_SIZE, 0, BENCHMARK_FLIPS_PAGES
+  },
+  {
+    "c13plain32", "Mode 0x13 (VGA): Plain, back buffer copy (movsd, 386+)",
+    SetupChunky, DrawChunkyFrame, TeardownChunky,
+    1, CHUNKY_SCREEN_SIZE, CHUNKY_DWORD, BENCHMARK_FLIPS_PAGES
+  },
+  {
+    "c13tiled", "Mode 0x13 (VGA): Tiled, back buffer copy (movsw)",
+    SetupChunky, DrawChunkyFrame, TeardownChunky,
+    1, CHUNKY_SCREEN_SIZE, CHUNKY_TILES, BENCHMARK_FLIPS_PAGES
+  },
+  {
+    "c13tiled32", "Mode 0x13 (VGA): Tiled, back buffer copy (movsd, 386+)",
+    SetupChunky, DrawChunkyFrame, TeardownChunky,
+    1, CHUNKY_SCREEN_SIZE, CHUNKY_TILES | CHUNKY_DWORD, BENCHMARK_FLIPS_PAGES
+  },
+  {
+    "c13sprites", "Mode 0x13 (VGA): Sprites over tiles, back buffer copy",
+    SetupChunky, DrawChunkyFrame, TeardownChunky,
+    1, CHUNKY_SCREEN_SIZE, CHUNKY_TILES | CHUNKY_SPRITES,
+    BENCHMARK_FLIPS_PAGES | BENCHMARK_SCALES_SPRITES
+  },
+  {
+    "bbsprites", "Back buffer, sprites over static tiles",
+    SetupBackBuffer, DrawBackBufferFrame, TeardownBackBuffer,
+    1, 0, 0, BENCHMARK_SCALES_SPRITES
+  },
+  {
+    "bbdirty5", "Back buffer (5% changed)",
+    SetupBackBuffer, DrawBackBufferFrame, TeardownBackBuffer,
+    1, SCREEN_BYTES * 5 / 100, 5, 0
+  },
+  {
+    "bbdirty25", "Back buffer (25% changed)",
+    SetupBackBuffer, DrawBackBufferFrame, TeardownBackBuffer,
+    1, SCREEN_BYTES * 25 / 100, 25, 0
+  },
+  {
+    "bbdirty100", "Back buffer (100% changed)",
+    SetupBackBuffer, DrawBackBufferFrame, TeardownBackBuffer,
+    1, SCREEN_BYTES, 100, 0
+  },
+  {
+    "vstosb", "Raw: rep stosb to video memory",
+    SetupMicroBytes, DrawMicroStosbFrame, NULL, 1, MICRO_BYTES, 0, 0
+  },
+  {
+    "vstosw", "Raw: rep stosw to video memory",
+    SetupMicroBytes, DrawMicroStoswFrame, NULL, 1, MICRO_BYTES, 0, 0
+  },
+  {
+    "vmovsb", "Raw: rep movsb from main to video memory",
+    SetupMicroBytes, DrawMicroMovsbFrame, NULL, 1, MICRO_BYTES, 0, 0
+  },
+  {
+    "vread", "Raw: rep movsb from video to main memory",
+    SetupMicroBytes, DrawMicroReadFrame, NULL, 1, MICRO_BYTES, 0, 0
+  },
+  {
+    // Each byte copied moves 4 bytes in video memory, one per plane
+    "vlatch", "Raw: rep movsb latch copy (write mode 1)",
+    SetupMicroBytes, DrawMicroLatchFrame, NULL, 1, MICRO_BYTES, 0, 0
+  },
+  {
+    "vout", "Raw: OUT to 0x3c4/0x3ce (as in EGA_SELECT_PLANE)",
+    SetupMicroOuts, DrawMicroOutFrame, NULL, 1, 0, 0, 0
+  }
+};
+
+#define NUM_BENCHMARKS (int)(sizeof(BENCHMARKS) / sizeof(BENCHMARKS[0]))
 
-  EGA_SELECT_PLANE_2();
-  asm xor di, di
-  asm mov cx, bx
-  asm rep movsw
 
-  EGA_SELECT_PLANE_3();
-  asm xor di, di
-  asm mov cx, bx
-  asm rep movsw
+// Measurements taken with vsync presentation, see RecordPresent()
+typedef struct
+{
+  dword refreshTicks;
+  dword firstPresent;
+  dword lastPresent;
+  dword idleTicks;
+  dword latencyTicks;
+  int presented;
+  int missedFrames;
+} PresentationStats;
+
+
+static void InitPresentationStats(
+  PresentationStats* presentation,
+  dword refreshTicks,
+  dword start)
+{
+  memset(presentation, 0, sizeof(PresentationStats));
+  presentation->refreshTicks = refreshTicks;
+  presentation->lastPresent = start;
 }
 
 
-static void DrawTiledFullscreen(void)
+// Records a frame that became visible at presentTicks, after drawing started
+// at frameStart. The recorded frame time is the interval between two
+// presents, which makes it a multiple of the refresh period. Frames taking
+// longer than one refresh period have missed a vsync. The latency is the time
+// from starting to draw a frame (i.e. when a game would sample its input)
+// until it's on screen. The first frame is the warm-up frame, used to size
+// the histogram.
+static void RecordPresent(
+  FrameStats* stats,
+  PresentationStats* presentation,
+  dword presentTicks,
+  dword frameStart)
 {
-  int col;
-  int row;
-  int idx = 0;
-
-  EGA_SETUP_LATCH_COPY();
+  dword interval = presentTicks - presentation->lastPresent;
+  dword refreshTicks = presentation->refreshTicks;
 
-  for (row = 0; row < 25 * 320; row += 320)
+  if (presentation->presented == 0)
   {
-    for (col = 0; col < 40; col++)
+    InitFrameStats(stats, interval);
+    presentation->firstPresent = presentTicks;
+  }
+  else
+  {
+    RecordFrame(stats, interval);
+    presentation->latencyTicks += presentTicks - frameStart;
+
+    if (interval > refreshTicks + refreshTicks / 2)
     {
-      DrawSolidTile(idx, col + row);
-      idx += 8;
+      presentation->missedFrames++;
     }
   }
+
+  presentation->presented++;
+  presentation->lastPresent = presentTicks;
 }
 
 
-static void DrawTiledFullscreenSlow(char near* buffer)
+// Double-buffered presentation: Each frame is drawn into the back page, which
+// is then made visible via the CRTC start address. Before drawing the next
+// frame, we wait for the vertical retrace, since that's when the new start
+// address takes effect and the previous front page can safely be overwritten.
+static void TimeVsyncFrames(
+  const Benchmark* benchmark,
+  FrameStats* stats,
+  int iterations,
+  PresentationStats* presentation)
 {
-  int col;
-  int row;
+  dword refreshTicks = MeasureRefreshTicks();
+  dword frameStart;
+  dword waitStart;
+  dword now;
+  int page = 1;
+  int i;
 
-  EGA_SET_DEFAULT_MODE();
+  WaitForRetrace();
+  InitPresentationStats(presentation, refreshTicks, ReadHighResClock());
 
-  for (row = 0; row < 25 * 320; row += 320)
+  for (i = 0; i <= iterations; ++i)
   {
-    for (col = 0; col < 40; col++)
+    frameStart = ReadHighResClock();
+
+    drawPageOffset = page * PAGE_SIZE;
+    benchmark->drawFrame();
+    SetStartAddress(drawPageOffset);
+
+    waitStart = ReadHighResClock();
+    WaitForRetrace();
+    now = ReadHighResClock();
+
+    if (i > 0)
     {
-      DrawSolidTileSlow(buffer, col + row);
-      buffer += 32;
+      presentation->idleTicks += now - waitStart;
     }
+
+    RecordPresent(stats, presentation, now, frameStart);
+    page ^= 1;
   }
+
+  drawPageOffset = 0;
 }
 
 
-static void ClearScreen(void)
+// Triple-buffered presentation: Once a frame is drawn, its page is queued by
+// writing its start address to the CRTC, and drawing continues right away
+// with the third page, which is neither on screen nor queued. The timer
+// interrupt notices when the queued page becomes visible (see TrackRetrace()),
+// which frees the previous front page. We only have to wait if a frame is
+// finished while the previous one is still queued, i.e. when drawing is
+// faster than the display refresh.
+static void TimeTripleBufferedFrames(
+  const Benchmark* benchmark,
+  FrameStats* stats,
+  int iterations,
+  word thirdPageOffset,
+  PresentationStats* presentation)
 {
+  word pageOffsets[3];
+  dword refreshTicks = MeasureRefreshTicks();
+  dword frameStart;
+  dword queuedFrameStart = 0;
+  dword waitStart;
+  int page = 1;
   int i;
 
-  outport(0x03c4, (0x0f << 8) | 0x02);  /* map mask: all planes active */
+  pageOffsets[0] = 0;
+  pageOffsets[1] = PAGE_SIZE;
+  pageOffsets[2] = thirdPageOffset;
 
-  for (i = 0; i < 8000; i++)
+  WaitForRetrace();
+  BeginRetraceTracking(refreshTicks);
+  InitPresentationStats(presentation, refreshTicks, lastFlipTicks);
+
+  for (i = 0; i <= iterations + 1; ++i)
   {
-    VMEM[i] = 0;
+    frameStart = ReadHighResClock();
+
+    if (i <= iterations)
+    {
+      drawPageOffset = pageOffsets[page];
+      benchmark->drawFrame();
+    }
+
+    // The previously queued frame needs to be on screen before queuing the
+    // next one. After the last frame, this waits for it to be shown.
+    waitStart = ReadHighResClock();
+    while (latchingPage != NO_PAGE);
+
+    if (i > 0)
+    {
+      if (i <= iterations)
+      {
+        presentation->idleTicks += ReadHighResClock() - waitStart;
+      }
+
+      RecordPresent(stats, presentation, lastFlipTicks, queuedFrameStart);
+    }
+
+    if (i <= iterations)
+    {
+      disable();
+
+      SetStartAddress(drawPageOffset);
+      latchingPage = page;
+
+      // Pages are numbered 0 to 2, so this is the remaining one
+      page = 3 - shownPage - page;
+
+      enable();
+
+      queuedFrameStart = frameStart;
+    }
   }
+
+  EndRetraceTracking();
+  drawPageOffset = 0;
 }
 
 
-static int numIterations = DEFAULT_ITERATIONS;
+// Writes the frame rate, missed vsyncs, idle time and latency to the note. If
+// compareTo is given, its frame rate and latency are added for comparison.
+static void DescribePresentation(
+  char* note,
+  const PresentationStats* presentation,
+  const PresentationStats* compareTo)
+{
+  char text[NOTE_LENGTH];
+  dword elapsed = presentation->lastPresent - presentation->firstPresent;
+  int frames = presentation->presented - 1;
+
+  if (frames <= 0 || elapsed == 0)
+  {
+    return;
+  }
 
+  sprintf(
+    note,
+    "%.1f fps, %d missed vsync, %.0f%% idle, %.1f ms latency",
+    frames * (float)PIT_FREQUENCY / elapsed,
+    presentation->missedFrames,
+    100.0f * presentation->idleTicks / elapsed,
+    TicksToMs(presentation->latencyTicks / frames));
 
-static float TicksToMsPerIteration(dword ticks)
-{
-  float factor = (float)DEFAULT_TIMER_RATE / (float)timerRate;
-  return (float)ticks * factor / (float)numIterations;
+  if (compareTo && compareTo->presented > 1)
+  {
+    elapsed = compareTo->lastPresent - compareTo->firstPresent;
+    frames = compareTo->presented - 1;
+
+    sprintf(
+      text,
+      "double: %.1f fps, %.1f ms latency",
+      frames * (float)PIT_FREQUENCY / elapsed,
+      TicksToMs(compareTo->latencyTicks / frames));
+  }
+  else
+  {
+    sprintf(text, "%.1f Hz", (float)PIT_FREQUENCY / presentation->refreshTicks);
+  }
+
+  AppendNote(note, text);
 }
 
 
-int main(int argc, char** argv)
+// Times the given number of frames (plus a warm-up frame) via
+// TimeWithoutInterrupts(). Returns 0 if any frame came close to taking one
+// PIT period, in which case the measurement can't be trusted.
+static int TimeFramesWithoutInterrupts(
+  const Benchmark* benchmark,
+  FrameStats* stats,
+  int iterations)
 {
-  FILE* fp;
-  char near* buffer;
-  dword plainTicks, tiledTicks, tiledTicksSlow;
+  dword ticks;
+  int i;
+
+  BeginInterruptFreeTiming();
 
-  if (argc >= 2)
+  for (i = 0; i <= iterations; ++i)
   {
-    numIterations = atoi(argv[1]);
+    ticks = TimeWithoutInterrupts(benchmark->drawFrame);
+
+    if (ticks > INTERRUPT_FREE_MAX_TICKS)
+    {
+      break;
+    }
+
+    if (i == 0)
+    {
+      InitFrameStats(stats, ticks);
+    }
+    else
+    {
+      RecordFrame(stats, ticks);
+    }
   }
 
-  if (argc >= 3)
+  EndInterruptFreeTiming();
+
+  return i > iterations;
+}
+
+
+static int RunBenchmark(const Benchmark* benchmark, BenchmarkResult* result)
+{
+  static FrameStats interruptFreeStats;
+  static FrameStats frameStats;
+  FrameStats* stats = &frameStats;
+  int i;
+  int iterations = numIterations / benchmark->iterationDivisor;
+  float interruptsMeanMs = 0.0f;
+  char text[NOTE_LENGTH];
+  PresentationStats presentation;
+  PresentationStats doubleBuffered;
+  word thirdPageOffset;
+  dword vramMark;
+  dword start;
+
+  if (vsyncMode && !(benchmark->flags & BENCHMARK_PAGED))
   {
-    timerRate = atoi(argv[2]);
+    return 0;
   }
 
-  // Setup
-  InitVideo();
-  InstallTimer(timerRate);
-  SetDuke2Palette();
-
-  buffer = malloc(32000);
+  benchmarkParam = benchmark->param;
+  frameBytes = benchmark->bytesPerFrame;
+  benchmarkNote[0] = '\0';
+  baselineTicks = 0;
+  frameOps = 0;
 
-  /*****************************************************************************
+  vramMark = MarkVram();
 
-    Benchmark 1: Measure drawing a fullscreen image, plane by plane
+  if (tripleBuffering && !AllocVram(PAGE_SIZE, PAGE_SIZE, &thirdPageOffset))
+  {
+    return 0;
+  }
 
-  *****************************************************************************/
-  fp = fopen("BONUSSCN.MNI", "rb");
-  fread(buffer, 32000, 1, fp);
-  fclose(fp);
+  if (!benchmark->setup())
+  {
+    ReleaseVram(vramMark);
+    return 0;
+  }
 
-  // Show the image on screen once, to check that it works correctly (and so
+  // Show one frame on screen, to check that it works correctly (and so
   // that there's at least something to see)
-  DrawFullscreen(buffer);
   SetDisplayPage(0);
-  WaitMs(1500);
+  benchmark->drawFrame();
+  WaitMs(PREVIEW_MS);
+
+  if (vsyncMode)
+  {
+    TimeVsyncFrames(benchmark, stats, iterations, &presentation);
+
+    // The double-buffered run serves as a comparison, the triple-buffered
+    // one then provides the recorded frame times
+    if (tripleBuffering)
+    {
+      doubleBuffered = presentation;
 
-  // To simulate a game that does double-buffering, switch the active
-  // (displayed) page to 1. This will cause the drawing code to write into
-  // page 0, which is now off-screen.
-  SetDisplayPage(1);
+      TimeTripleBufferedFrames(
+        benchmark, stats, iterations, thirdPageOffset, &presentation);
+    }
 
+    DescribePresentation(
+      benchmarkNote, &presentation, tripleBuffering ? &doubleBuffered : NULL);
+  }
+  else
   {
-    int i;
+    // To simulate a game that does double-buffering, switch the active
+    // (displayed) page to 1. This will cause the drawing code to write into
+    // page 0, which is now off-screen.
+    if (!(benchmark->flags & BENCHMARK_FLIPS_PAGES))
+    {
+      SetDisplayPage(1);
+    }
 
-    tickCounter = 0;
+    // Time one warm-up frame to size the histogram
+    start = ReadHighResClock();
+    benchmark->drawFrame();
+    InitFrameStats(stats, ReadHighResClock() - start);
 
-    for (i = 0; i < numIterations; ++i)
+    for (i = 0; i < iterations; ++i)
     {
-      DrawFullscreen(buffer);
+      start = ReadHighResClock();
+      benchmark->drawFrame();
+      RecordFrame(stats, ReadHighResClock() - start);
     }
 
-    plainTicks = tickCounter;
+    // Repeat the measurement without any interrupts, the result then replaces
+    // the regular one. Frames that are too slow for that keep the regular
+    // result.
+    if (
+      interruptFreeMode &&
+      !(benchmark->flags & BENCHMARK_NEEDS_INTERRUPTS) &&
+      stats->max <= INTERRUPT_FREE_MAX_TICKS &&
+      TimeFramesWithoutInterrupts(benchmark, &interruptFreeStats, iterations))
+    {
+      interruptsMeanMs = FrameMeanMs(stats);
+      *stats = interruptFreeStats;
+    }
   }
 
   SetDisplayPage(0);
+
+  // Leave the write mode in its default state for ClearScreen and for the
+  // next benchmark's setup
+  EGA_SET_DEFAULT_MODE();
   ClearScreen();
 
-  /*****************************************************************************
+  if (benchmark->teardown)
+  {
+    benchmark->teardown();
+  }
 
-    Benchmark 2: Measure drawing a screen full of 8x8 tiles, using latch copies
+  ReleaseVram(vramMark);
 
-  *****************************************************************************/
-  fp = fopen("DROP12.MNI", "rb");
-  fread(buffer, 32000, 1, fp);
-  fclose(fp);
+  SummarizeFrameStats(stats, frameBytes, result);
+  strcpy(result->note, benchmarkNote);
 
-  // Copy the data to vram so that we can draw it via latch copy
-  CopyTilesToVram(buffer, 8000, 0x4000);
+  // Vsync presentation quantizes frame times to the refresh rate, so a
+  // comparison against the baseline's raw drawing time wouldn't be meaningful
+  if (baselineTicks && !vsyncMode && result->meanMs > 0.0f)
+  {
+    sprintf(
+      text,
+      "%.2fx the speed of %s",
+      TicksToMs(baselineTicks) / result->meanMs,
+      baselineName);
+    AppendNote(result->note, text);
+  }
+
+  if (interruptsMeanMs > 0.0f && result->meanMs > 0.0f)
+  {
+    sprintf(
+      text,
+      "with timer: %.3f ms (%+.1f%%)",
+      interruptsMeanMs,
+      100.0f * (interruptsMeanMs - result->meanMs) / result->meanMs);
+    AppendNote(result->note, text);
+  }
+  else if (interruptFreeMode && !vsyncMode)
+  {
+    AppendNote(result->note, "timed with interrupts");
+  }
+
+  if (frameOps && result->meanMs > 0.0f)
+  {
+    sprintf(text, "%.1f ns/op", result->meanMs * 1000000.0f / frameOps);
+    AppendNote(result->note, text);
+
+    if (frameBytes)
+    {
+      sprintf(text, "%.2f bytes/us", result->bytesPerSecond / 1000000.0f);
+      AppendNote(result->note, text);
+    }
+  }
+
+  return 1;
+}
 
-  DrawTiledFullscreen();
-  WaitMs(250);
 
-  // Same as above
-  SetDisplayPage(1);
+// Frame budget mode: Runs the benchmark repeatedly with an increasing number of
+// sprites, to find the maximum that still fits into the frame budget. A load
+// fits if the 95th percentile of frame times is within the budget, so that
+// occasional outliers (e.g. due to the timer interrupt) don't count. The
+// number of sprites is doubled until a load doesn't fit anymore, followed by
+// a binary search between the last two loads. This assumes that drawing time
+// grows with the number of sprites. The result is that of the maximum load,
+// or of a single sprite if even that doesn't fit.
+static int FindMaxSprites(const Benchmark* benchmark, BenchmarkResult* result)
+{
+  static BenchmarkResult attempt;
+  char note[NOTE_LENGTH];
+  int savedNumSprites = numSprites;
+  int fits = 0;
+  int doesntFit = MAX_SPRITES + 1;
+
+  numSprites = 1;
 
+  while (doesntFit - fits > 1)
   {
-    int i;
+    if (!RunBenchmark(benchmark, &attempt))
+    {
+      numSprites = savedNumSprites;
+      return 0;
+    }
+
+    if (attempt.p95Ms <= frameBudgetMs)
+    {
+      fits = numSprites;
+      *result = attempt;
+    }
+    else
+    {
+      doesntFit = numSprites;
 
-    tickCounter = 0;
+      if (fits == 0)
+      {
+        *result = attempt;
+      }
+    }
 
-    for (i = 0; i < numIterations; ++i)
+    if (doesntFit <= MAX_SPRITES)
+    {
+      numSprites = (fits + doesntFit) / 2;
+    }
+    else
     {
-      DrawTiledFullscreen();
+      numSprites = fits * 2 < MAX_SPRITES ? fits * 2 : MAX_SPRITES;
     }
+  }
 
-    tiledTicks = tickCounter;
+  numSprites = savedNumSprites;
+
+  // The note of the run at the maximum load follows, as far as it fits
+  sprintf(note, "max. %d sprites within %.1f ms", fits, frameBudgetMs);
+
+  if (result->note[0])
+  {
+    strcat(note, ", ");
+    strncat(note, result->note, NOTE_LENGTH - 1 - strlen(note));
   }
 
-  SetDisplayPage(0);
-  ClearScreen();
+  strcpy(result->note, note);
+  return 1;
+}
+
+
+static FILE* OpenCsvFile(const char* filename)
+{
+  FILE* fp = fopen(filename, "a");
+
+  if (!fp)
+  {
+    return NULL;
+  }
 
-  /*****************************************************************************
+  // Write a header if the file is new
+  fseek(fp, 0, SEEK_END);
+  if (ftell(fp) == 0)
+  {
+    fprintf(
+      fp,
+      "run,method,iterations,timer_rate,presentation,mean_ms,min_ms,max_ms,"
+      "p50_ms,p95_ms,p99_ms,std_dev_ms,bytes_per_s,note,cpu,video,"
+      "video_kb,vram_write8_bytes_per_s,vram_write16_bytes_per_s,"
+      "vram_read16_bytes_per_s\n");
+  }
+
+  return fp;
+}
 
-    Benchmark 3: Measure drawing a screen full of 8x8 tiles, from main memory
 
-  *****************************************************************************/
+static void WriteCsvResult(
+  FILE* fp,
+  int run,
+  const Benchmark* benchmark,
+  const BenchmarkResult* result,
+  const HardwareInfo* hardware)
+{
+  fprintf(
+    fp,
+    "%d,%s,%u,%d,%s,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.0f,\"%s\","
+    "%d,%s,%u,%.0f,%.0f,%.0f\n",
+    run,
+    benchmark->name,
+    result->frames,
+    timerRate,
+    tripleBuffering ? "triple" : vsyncMode ? "vsync" : "immediate",
+    result->meanMs,
+    result->minMs,
+    result->maxMs,
+    result->p50Ms,
+    result->p95Ms,
+    result->p99Ms,
+    result->stdDevMs,
+    result->bytesPerSecond,
+    result->note,
+    hardware->cpuClass,
+    hardware->videoAdapter,
+    hardware->videoMemoryKb,
+    hardware->writeBytesPerSecond,
+    hardware->writeWordsBytesPerSecond,
+    hardware->readBytesPerSecond);
+}
 
-  DrawTiledFullscreenSlow(buffer);
-  WaitMs(250);
 
-  // Same as above
-  SetDisplayPage(1);
+static int SelectBenchmarks(char* list, int* selected)
+{
+  char* name;
+  int i;
 
+  for (i = 0; i < NUM_BENCHMARKS; ++i)
   {
-    int i;
+    selected[i] = 0;
+  }
 
-    tickCounter = 0;
+  for (name = strtok(list, ","); name; name = strtok(NULL, ","))
+  {
+    for (i = 0; i < NUM_BENCHMARKS; ++i)
+    {
+      if (strcmp(name, BENCHMARKS[i].name) == 0)
+      {
+        selected[i] = 1;
+        break;
+      }
+    }
 
-    // This benchmark is very slow, so only run half the iterations and then
-    // multiply the result by 2
-    for (i = 0; i < numIterations/2; ++i)
+    if (i == NUM_BENCHMARKS)
     {
-      DrawTiledFullscreenSlow(buffer);
+      printf("Unknown benchmark: %s\n", name);
+      return 0;
     }
+  }
+
+  return 1;
+}
+
 
-    tiledTicksSlow = tickCounter*2;
+static void PrintUsage(void)
+{
+  int i;
+
+  printf(
+    "Usage: egabench [options] [num_iterations] [timer_rate]\n\n"
+    "  -b <names>  Comma-separated list of benchmarks to run\n"
+    "  -r <count>  Repeat all selected benchmarks <count> times\n"
+    "  -o <file>   Append results to a CSV file\n"
+    "  -s <count>  Number of sprites to draw (default: %d)\n"
+    "  -v          Flip pages in sync with the vertical retrace, and report\n"
+    "              the achieved frame rate (only for some benchmarks)\n"
+    "  -t          Like -v, but with triple buffering, and compare against\n"
+    "              double buffering\n"
+    "  -i          Time frames with interrupts disabled, and report the\n"
+    "              difference to timing with the timer interrupt\n"
+    "  -f <ms>     Find the maximum number of sprites that can be drawn\n"
+    "              within the given frame time, e.g. 14.3 for 70 Hz (only\n"
+    "              for benchmarks drawing sprites)\n\n"
+    "Available benchmarks:\n",
+    DEFAULT_SPRITES);
+
+  for (i = 0; i < NUM_BENCHMARKS; ++i)
+  {
+    printf("  %-10s %s\n", BENCHMARKS[i].name, BENCHMARKS[i].description);
   }
+}
 
-  SetDisplayPage(0);
+
+int main(int argc, char** argv)
+{
+  static BenchmarkResult results[NUM_BENCHMARKS];
+  static int completed[NUM_BENCHMARKS];
+  static int selected[NUM_BENCHMARKS];
+  HardwareInfo hardware;
+  int numRepeats = 1;
+  int positionalArgs = 0;
+  const char* csvFilename = NULL;
+  FILE* csvFile = NULL;
+  int i;
+  int run;
+
+  for (i = 0; i < NUM_BENCHMARKS; ++i)
+  {
+    selected[i] = 1;
+  }
+
+  for (i = 1; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "-v") == 0)
+    {
+      vsyncMode = 1;
+    }
+    else if (strcmp(argv[i], "-t") == 0)
+    {
+      vsyncMode = 1;
+      tripleBuffering = 1;
+    }
+    else if (strcmp(argv[i], "-i") == 0)
+    {
+      interruptFreeMode = 1;
+    }
+    else if (argv[i][0] == '-')
+    {
+      if (argv[i][1] == '\0' || argv[i][2] != '\0' || i + 1 >= argc)
+      {
+        PrintUsage();
+        return 1;
+      }
+
+      switch (argv[i][1])
+      {
+        case 'b':
+          if (!SelectBenchmarks(argv[++i], selected))
+          {
+            return 1;
+          }
+          break;
+
+        case 'r':
+          numRepeats = atoi(argv[++i]);
+          break;
+
+        case 'o':
+          csvFilename = argv[++i];
+          break;
+
+        case 'f':
+          frameBudgetMs = atof(argv[++i]);
+
+          if (frameBudgetMs <= 0.0f)
+          {
+            printf("Frame budget must be a positive number of milliseconds\n");
+            return 1;
+          }
+          break;
+
+        case 's':
+          numSprites = atoi(argv[++i]);
+
+          if (numSprites < 0 || numSprites > MAX_SPRITES)
+          {
+            printf("Number of sprites must be between 0 and %d\n", MAX_SPRITES);
+            return 1;
+          }
+          break;
+
+        default:
+          PrintUsage();
+          return 1;
+      }
+    }
+    else if (positionalArgs == 0)
+    {
+      numIterations = atoi(argv[i]);
+      ++positionalArgs;
+    }
+    else if (positionalArgs == 1)
+    {
+      timerRate = atoi(argv[i]);
+      ++positionalArgs;
+    }
+    else
+    {
+      PrintUsage();
+      return 1;
+    }
+  }
+
+  if (csvFilename)
+  {
+    csvFile = OpenCsvFile(csvFilename);
+
+    if (!csvFile)
+    {
+      printf("Could not open %s for writing\n", csvFilename);
+      return 1;
+    }
+  }
+
+  // Setup
+  InitVideo();
+  InstallTimer(timerRate);
+  SetDuke2Palette();
+
+#ifdef PROFILE
+  CalibrateProfiler();
+#endif
+
+  ProbeHardware(&hardware);
+  ClearScreen();
+
+  InitVramAllocator(hardware.videoMemoryKb);
+
+  if (!ReserveFixedVram())
+  {
+    RemoveTimer();
+    ExitVideo();
+
+    if (csvFile)
+    {
+      fclose(csvFile);
+    }
+
+    printf("At least 128 KB of video memory are required\n");
+    return 1;
+  }
+
+  buffer = malloc(32000);
+
+  for (run = 1; run <= numRepeats; ++run)
+  {
+    for (i = 0; i < NUM_BENCHMARKS; ++i)
+    {
+      if (!selected[i])
+      {
+        continue;
+      }
+
+      if (frameBudgetMs > 0.0f)
+      {
+        completed[i] =
+          (BENCHMARKS[i].flags & BENCHMARK_SCALES_SPRITES) &&
+          FindMaxSprites(&BENCHMARKS[i], &results[i]);
+      }
+      else
+      {
+        completed[i] = RunBenchmark(&BENCHMARKS[i], &results[i]);
+      }
+
+      if (completed[i] && csvFile)
+      {
+        WriteCsvResult(csvFile, run, &BENCHMARKS[i], &results[i], &hardware);
+      }
+    }
+  }
 
   // Cleanup
   free(buffer);
 
+  if (csvFile)
+  {
+    fclose(csvFile);
+  }
+
   RemoveTimer();
   ExitVideo();
 
   // Report
-  printf("Results for %d iterations:\n", numIterations);
+  PrintHardwareInfo(&hardware);
   printf(
-    "%f ms plain, %f ms tiled (fast), %f ms tiled (slow)\n",
-    TicksToMsPerIteration(plainTicks),
-    TicksToMsPerIteration(tiledTicks),
-    TicksToMsPerIteration(tiledTicksSlow));
+    "Off-screen video memory for benchmarks: %lu bytes per plane\n\n",
+    FreeVram());
+
+  if (numRepeats > 1)
+  {
+    printf("Results of the last of %d runs, ", numRepeats);
+  }
+  else
+  {
+    printf("Results ");
+  }
+
+  printf("for %d iterations:\n", numIterations);
+
+  for (i = 0; i < NUM_BENCHMARKS; ++i)
+  {
+    if (!selected[i])
+    {
+      continue;
+    }
+
+    if (completed[i])
+    {
+      PrintResult(BENCHMARKS[i].description, &results[i]);
+    }
+    else
+    {
+      printf(
+        "%s: skipped (data files missing or not supported)\n",
+        BENCHMARKS[i].description);
+    }
+  }
+
+#ifdef PROFILE
+  PrintProfile();
+#endif
 
   return 0;
 }